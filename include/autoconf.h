@@ -36,6 +36,11 @@
 #define IF_FEATURE_VI_8BIT(...)
 #define IF_NOT_FEATURE_VI_8BIT(...) __VA_ARGS__
 
+#define CONFIG_FEATURE_VI_UTF8 1
+#define ENABLE_FEATURE_VI_UTF8 1
+#define IF_FEATURE_VI_UTF8(...) __VA_ARGS__
+#define IF_NOT_FEATURE_VI_UTF8(...)
+
 #define CONFIG_FEATURE_VI_COLON 1
 #define ENABLE_FEATURE_VI_COLON 1
 #define IF_FEATURE_VI_COLON(...) __VA_ARGS__
@@ -51,10 +56,15 @@
 #define IF_FEATURE_VI_SEARCH(...) __VA_ARGS__
 #define IF_NOT_FEATURE_VI_SEARCH(...)
 
-#undef CONFIG_FEATURE_VI_REGEX_SEARCH
-#define ENABLE_FEATURE_VI_REGEX_SEARCH 0
-#define IF_FEATURE_VI_REGEX_SEARCH(...)
-#define IF_NOT_FEATURE_VI_REGEX_SEARCH(...) __VA_ARGS__
+#define CONFIG_FEATURE_VI_REGEX_SEARCH 1
+#define ENABLE_FEATURE_VI_REGEX_SEARCH 1
+#define IF_FEATURE_VI_REGEX_SEARCH(...) __VA_ARGS__
+#define IF_NOT_FEATURE_VI_REGEX_SEARCH(...)
+
+#define CONFIG_FEATURE_VI_SEARCH_THREADS 1
+#define ENABLE_FEATURE_VI_SEARCH_THREADS 1
+#define IF_FEATURE_VI_SEARCH_THREADS(...) __VA_ARGS__
+#define IF_NOT_FEATURE_VI_SEARCH_THREADS(...)
 
 #define CONFIG_FEATURE_VI_USE_SIGNALS 1
 #define ENABLE_FEATURE_VI_USE_SIGNALS 1
@@ -66,6 +76,16 @@
 #define IF_FEATURE_VI_DOT_CMD(...) __VA_ARGS__
 #define IF_NOT_FEATURE_VI_DOT_CMD(...)
 
+#define CONFIG_FEATURE_VI_MAP 1
+#define ENABLE_FEATURE_VI_MAP 1
+#define IF_FEATURE_VI_MAP(...) __VA_ARGS__
+#define IF_NOT_FEATURE_VI_MAP(...)
+
+#define CONFIG_FEATURE_VI_MACRO 1
+#define ENABLE_FEATURE_VI_MACRO 1
+#define IF_FEATURE_VI_MACRO(...) __VA_ARGS__
+#define IF_NOT_FEATURE_VI_MACRO(...)
+
 #define CONFIG_FEATURE_VI_READONLY 1
 #define ENABLE_FEATURE_VI_READONLY 1
 #define IF_FEATURE_VI_READONLY(...) __VA_ARGS__
@@ -81,6 +101,11 @@
 #define IF_FEATURE_VI_SET(...) __VA_ARGS__
 #define IF_NOT_FEATURE_VI_SET(...)
 
+#define CONFIG_FEATURE_VI_SYNTAX 1
+#define ENABLE_FEATURE_VI_SYNTAX 1
+#define IF_FEATURE_VI_SYNTAX(...) __VA_ARGS__
+#define IF_NOT_FEATURE_VI_SYNTAX(...)
+
 #define CONFIG_FEATURE_VI_WIN_RESIZE 1
 #define ENABLE_FEATURE_VI_WIN_RESIZE 1
 #define IF_FEATURE_VI_WIN_RESIZE(...) __VA_ARGS__
@@ -91,6 +116,31 @@
 #define IF_FEATURE_VI_ASK_TERMINAL(...) __VA_ARGS__
 #define IF_NOT_FEATURE_VI_ASK_TERMINAL(...)
 
+#define CONFIG_FEATURE_VI_TERM_PROBE 1
+#define ENABLE_FEATURE_VI_TERM_PROBE 1
+#define IF_FEATURE_VI_TERM_PROBE(...) __VA_ARGS__
+#define IF_NOT_FEATURE_VI_TERM_PROBE(...)
+
+#define CONFIG_FEATURE_VI_WRITER_THREAD 1
+#define ENABLE_FEATURE_VI_WRITER_THREAD 1
+#define IF_FEATURE_VI_WRITER_THREAD(...) __VA_ARGS__
+#define IF_NOT_FEATURE_VI_WRITER_THREAD(...)
+
+#define CONFIG_FEATURE_VI_READER_THREAD 1
+#define ENABLE_FEATURE_VI_READER_THREAD 1
+#define IF_FEATURE_VI_READER_THREAD(...) __VA_ARGS__
+#define IF_NOT_FEATURE_VI_READER_THREAD(...)
+
+#define CONFIG_FEATURE_VI_PASTE 1
+#define ENABLE_FEATURE_VI_PASTE 1
+#define IF_FEATURE_VI_PASTE(...) __VA_ARGS__
+#define IF_NOT_FEATURE_VI_PASTE(...)
+
+#define CONFIG_FEATURE_VI_STATS 1
+#define ENABLE_FEATURE_VI_STATS 1
+#define IF_FEATURE_VI_STATS(...) __VA_ARGS__
+#define IF_NOT_FEATURE_VI_STATS(...)
+
 #define CONFIG_FEATURE_VI_UNDO 1
 #define ENABLE_FEATURE_VI_UNDO 1
 #define IF_FEATURE_VI_UNDO(...) __VA_ARGS__
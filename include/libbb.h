@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/stat.h>
 
@@ -111,6 +112,74 @@ int index_in_strings(const char *strings, const char *key) FAST_FUNC;
 // read_printf.c
 void *xmalloc_open_read_close(const char *filename, size_t *maxsz_p) FAST_FUNC RETURNS_MALLOC;
 
+// time.c
+unsigned long long monotonic_us(void) FAST_FUNC;
+unsigned long long monotonic_ms(void) FAST_FUNC;
+
+// unicode.c
+int utf8_locale(void) FAST_FUNC;
+int utf8_decode(const char *s, const char *end, unsigned *wc) FAST_FUNC;
+int utf8_encode(char *buf, unsigned wc) FAST_FUNC;
+int unicode_width(unsigned wc) FAST_FUNC;
+size_t printable_ascii_len(const char *s, size_t n) FAST_FUNC;
+
+// strsearch.c
+/* A pattern made ready to be searched for many times */
+struct strsearch {
+	char *pat;		// as given
+	char *key;		// what is looked for: pat, lower case if icase
+	int len;
+	int icase;		// letters match either case
+	int shift[256];		// Horspool skips for a forward search
+	int rshift[256];	// and for a backward one
+};
+void strsearch_init(struct strsearch *ss, const char *pat, int icase) FAST_FUNC;
+void strsearch_free(struct strsearch *ss) FAST_FUNC;
+char *strsearch_fwd(const struct strsearch *ss, const char *p, const char *end) FAST_FUNC;
+char *strsearch_back(const struct strsearch *ss, const char *start, const char *end) FAST_FUNC;
+
+// regex.c
+enum {
+	RX_ICASE = 1 << 0,	// letters match either case
+	RX_EXTENDED = 1 << 1,	// ERE: ( ) | + ? { } need no backslash
+	// for rx_search(): s[-1] and *end are text too,
+	// which ^ $ \< \> look at
+	RX_TEXT_BEFORE = 1 << 2,
+	RX_TEXT_AFTER = 1 << 3,
+	RX_MAX_SUB = 10,	// \0 .. \9
+};
+struct regex;
+struct regex *rx_compile(const char *pat, int flags, const char **err) FAST_FUNC;
+void rx_free(struct regex *re) FAST_FUNC;
+/* The leftmost-longest match in [s, end), or the one starting
+ * furthest on. sub[2 * i] and sub[2 * i + 1] are set to where
+ * group i < nsub starts and ends, or NULL. sub may be NULL if
+ * nsub is 0 */
+char *rx_search(struct regex *re, const char *s, const char *end, int flags, const char **sub, int nsub) FAST_FUNC;
+char *rx_search_back(struct regex *re, const char *s, const char *end, int flags, const char **sub, int nsub) FAST_FUNC;
+/* A copy of re to search with on another thread, sharing its program.
+ * It is freed with rx_free(), before re */
+struct regex *rx_clone(const struct regex *re) FAST_FUNC;
+/* Is every match of re within a line? */
+int rx_in_lines(const struct regex *re) FAST_FUNC;
+
+// par_search.c
+enum {
+	PAR_BACK = 1 << 0,	// the match nearest to end is wanted
+	PAR_LINES = 1 << 1,	// pieces are whole lines
+};
+/* Finds the match in [s, e) nearest to the start of it (to the end,
+ * with PAR_BACK). 'worker' is below par_threads(): calls with
+ * different ones can run at the same time */
+typedef char *par_fn(void *arg, int worker, const char *s, const char *e);
+/* Is the search to be given up? Asked on the caller's thread only */
+typedef int FAST_FUNC par_stop(void);
+int par_threads(void) FAST_FUNC;
+/* The match nearest to start (or end) in [start, end), which is
+ * searched piece by piece with fn(), on several threads if it is big.
+ * NULL if stop (which may be NULL) says so between pieces */
+char *par_search(par_fn *fn, par_stop *stop, void *arg, const char *start, const char *end, int flags) FAST_FUNC;
+
 // llist.c
 /* Having next pointer as a first member allows easy creation
  * of "llist-compatible" structs, and using llist_FOO functions
@@ -0,0 +1,193 @@
+/* vi: set sw=4 ts=4: */
+/*
+ * Searching a large range on several threads: it is cut in pieces,
+ * which the threads take in turn, nearest first. Once a piece has a
+ * match, the ones further on are not looked at. With one thread the
+ * pieces are still taken one by one, so that the search can be stopped.
+ *
+ * Licensed under GPLv2, see file LICENSE in this source tree.
+ */
+#include "libbb.h"
+#if ENABLE_FEATURE_VI_SEARCH_THREADS
+# include <pthread.h>
+# include <unistd.h>
+#endif
+
+enum {
+	PIECE = 1 << 20,	// bytes a thread looks at in one go
+	MIN_PIECES = 4,		// smaller ranges are searched as they are
+	MAX_THREADS = 8,
+};
+
+struct par_job {
+	par_fn *fn;
+	par_stop *stop;
+	void *arg;
+	const char **bound;	// piece i is bound[i]..bound[i + 1]-1
+	char **found;		// the match in the k-th nearest piece
+	int n;			// pieces
+	smallint back;
+	smallint stopped;	// stop() said so
+	int next;		// k of the piece to take next
+	int best;		// k of the nearest piece with a match, or n
+};
+
+static void work(struct par_job *job, int w)
+{
+	for (;;) {
+		int k = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		int i = job->back ? job->n - 1 - k : k;
+		int b;
+
+		// pieces are taken in order: once this one is past
+		// the best, so are all the others left
+		if (k >= __atomic_load_n(&job->best, __ATOMIC_ACQUIRE))
+			break;
+		// only the caller's thread asks, stop() need not be
+		// thread safe. The others see best and give up too
+		if (w == 0 && job->stop && job->stop()) {
+			job->stopped = 1;
+			__atomic_store_n(&job->best, 0, __ATOMIC_RELEASE);
+			break;
+		}
+		job->found[k] = NULL;
+		if (job->bound[i] < job->bound[i + 1])
+			job->found[k] = job->fn(job->arg, w, job->bound[i], job->bound[i + 1]);
+		if (!job->found[k])
+			continue;
+		b = __atomic_load_n(&job->best, __ATOMIC_RELAXED);
+		while (k < b && !__atomic_compare_exchange_n(&job->best, &b, k,
+					0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			continue;
+	}
+}
+
+#if ENABLE_FEATURE_VI_SEARCH_THREADS
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t go;	// a job is there
+	pthread_cond_t done;	// busy became 0
+	int threads;		// the caller's one included, 0: none yet
+	unsigned gen;		// bumped for each job
+	int busy;		// workers still on the job
+	struct par_job *job;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.go = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static void *worker(void *arg)
+{
+	int w = (intptr_t)arg;
+	unsigned seen = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		struct par_job *job;
+
+		while (pool.gen == seen)
+			pthread_cond_wait(&pool.go, &pool.lock);
+		seen = pool.gen;
+		job = pool.job;
+		pthread_mutex_unlock(&pool.lock);
+		work(job, w);
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.busy == 0)
+			pthread_cond_signal(&pool.done);
+	}
+	return NULL;
+}
+
+int FAST_FUNC par_threads(void)
+{
+	long n;
+	sigset_t all, old;
+
+	if (pool.threads)
+		return pool.threads;
+	n = MIN(sysconf(_SC_NPROCESSORS_ONLN), MAX_THREADS);
+	// signal handlers must run in the editor's thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (pool.threads = 1; pool.threads < n; pool.threads++) {
+		pthread_t tid;
+
+		if (pthread_create(&tid, NULL, worker, (void *)(intptr_t)pool.threads))
+			break;
+		pthread_detach(tid);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return pool.threads;
+}
+
+// work() on the job on all the threads, the caller's one too
+static void run_job(struct par_job *job)
+{
+	if (par_threads() < 2) {
+		work(job, 0);
+		return;
+	}
+	pthread_mutex_lock(&pool.lock);
+	pool.job = job;
+	pool.busy = pool.threads - 1;
+	pool.gen++;
+	pthread_cond_broadcast(&pool.go);
+	pthread_mutex_unlock(&pool.lock);
+	work(job, 0);
+	pthread_mutex_lock(&pool.lock);
+	while (pool.busy)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+#else
+int FAST_FUNC par_threads(void)
+{
+	return 1;
+}
+
+static void run_job(struct par_job *job)
+{
+	work(job, 0);
+}
+#endif
+
+char* FAST_FUNC par_search(par_fn *fn, par_stop *stop, void *arg,
+		const char *start, const char *end, int flags)
+{
+	struct par_job job;
+	char *found;
+	int i, n = (end - start) / PIECE;
+
+	// one thread which can't be stopped may as well do it all
+	if (n < MIN_PIECES || (!stop && par_threads() < 2))
+		return fn(arg, 0, start, end);
+	job.bound = xmalloc((n + 1) * sizeof(job.bound[0]));
+	job.bound[0] = start;
+	for (i = 1; i < n; i++) {
+		const char *b = MAX(start + (size_t)i * PIECE, job.bound[i - 1]);
+
+		if ((flags & PAR_LINES) && b < end) {
+			// on to the start of a line
+			b = memchr(b - 1, '\n', end - b + 1);
+			b = b ? b + 1 : end;
+		}
+		job.bound[i] = b;
+	}
+	job.bound[n] = end;
+	job.found = xmalloc(n * sizeof(job.found[0]));
+	job.fn = fn;
+	job.stop = stop;
+	job.arg = arg;
+	job.n = n;
+	job.back = flags & PAR_BACK;
+	job.stopped = 0;
+	job.next = 0;
+	job.best = n;
+	run_job(&job);
+
+	found = !job.stopped && job.best < n ? job.found[job.best] : NULL;
+	free(job.found);
+	free(job.bound);
+	return found;
+}
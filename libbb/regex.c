@@ -0,0 +1,1088 @@
+/* vi: set sw=4 ts=4: */
+/*
+ * Regular expressions: POSIX basic ones, with the GNU \+ \? \| \< \>,
+ * or extended ones. No back references.
+ *
+ * A pattern is compiled to the program of a Pike VM, which runs all
+ * the threads of the NFA in step over the text, so the time taken is
+ * linear in it. Matches are leftmost-longest, as POSIX wants, and only
+ * a newline in the pattern matches one: '.' and [^...] don't. A string
+ * which every match has in it is looked for first, with strsearch.
+ *
+ * Licensed under GPLv2, see file LICENSE in this source tree.
+ */
+#include "libbb.h"
+
+enum {
+	OP_CHAR,	// c
+	OP_ANY,		// any char but a newline
+	OP_CLASS,	// a char in cls[x]
+	OP_SPLIT,	// go on at pc + x, and at pc + y with a lower priority
+	OP_JMP,		// go on at pc + x
+	OP_SAVE,	// sub[c] = where we are
+	OP_BOL,		// ^
+	OP_EOL,		// $
+	OP_BOW,		// \<
+	OP_EOW,		// \>
+	OP_MATCH,
+};
+
+enum {
+	MAX_PROG = 10000,	// instructions
+	DUP_MAX = 255,		// in \{m,n\}
+};
+
+struct insn {
+	unsigned char op;
+	unsigned char c;
+	int x, y;
+};
+
+// The threads of the VM at one place in the text
+struct vm_list {
+	int n;
+	int *pc;
+	const char **sub;	// nslot of them for each pc
+	unsigned *mark;		// mark[pc] == gen: pc is on the list
+	unsigned gen;
+};
+
+struct vm_stack {
+	int pc;
+	int slot;		// if >= 0, restore sub[slot] = old
+	const char *old;
+};
+
+struct regex {
+	struct insn *prog;
+	int len;
+	unsigned char (*cls)[32];
+	int ncls;
+	int nsub;		// groups, the whole match as \0 included
+	smallint lines;		// no match spans a newline
+	smallint plain;		// the pattern is just lit
+	struct strsearch lit;	// in every match, if lit.pat
+	smallint any_first;	// a match can start anywhere, or else
+	int first_c;		//  only with this char if >= 0,
+	unsigned char first[256]; //  or with one of these
+	// the VM
+	struct vm_list l[2];
+	struct vm_stack *stack;
+	const char *seed[2 * RX_MAX_SUB];
+	const char *vs, *vend;	// the text it runs over
+	int vflags;
+	int nslot;		// of sub[] it keeps
+	const struct regex *of;	// cloned from, which owns prog, cls and lit
+};
+
+// State of rx_compile()
+struct rxc {
+	struct regex *re;
+	const char *p;		// what is left of the pattern
+	int flags;
+	int alloc;		// of re->prog
+	int depth;		// of groups
+	const char *err;
+	// the longest string of chars every match has
+	char *run, *best;
+	int run_len, best_len;
+	smallint alts;		// a | outside of groups: there is none
+	smallint plain;		// only chars so far
+};
+
+enum {
+	T_END = 256, T_ALT, T_OPEN, T_CLOSE, T_STAR, T_PLUS, T_QUES, T_BRACE,
+	T_ANY, T_BRACKET, T_BOL, T_EOL, T_BOW, T_EOW,
+};
+
+//----- Compiling ------------------------------------------------------
+
+static int emit(struct rxc *c, int op, int ch, int x, int y)
+{
+	struct regex *re = c->re;
+	struct insn *in;
+
+	if (re->len >= MAX_PROG) {
+		c->err = "pattern too big";
+		return re->len - 1;
+	}
+	if (re->len >= c->alloc) {
+		c->alloc = c->alloc * 2 + 16;
+		re->prog = xrealloc(re->prog, c->alloc * sizeof(re->prog[0]));
+	}
+	in = &re->prog[re->len];
+	in->op = op;
+	in->c = ch;
+	in->x = x;
+	in->y = y;
+	return re->len++;
+}
+
+// Put an instruction before the code from 'at' on. Jumps are
+// relative, so the code moved does not change
+static void insert(struct rxc *c, int at, int op, int x, int y)
+{
+	struct regex *re = c->re;
+	int n = re->len - at;
+
+	emit(c, op, 0, x, y);
+	if (c->err)
+		return;
+	memmove(&re->prog[at + 1], &re->prog[at], n * sizeof(re->prog[0]));
+	re->prog[at].op = op;
+	re->prog[at].c = 0;
+	re->prog[at].x = x;
+	re->prog[at].y = y;
+}
+
+static int add_class(struct rxc *c, const unsigned char *set)
+{
+	struct regex *re = c->re;
+
+	re->cls = xrealloc(re->cls, (re->ncls + 1) * sizeof(re->cls[0]));
+	memcpy(re->cls[re->ncls], set, sizeof(re->cls[0]));
+	return re->ncls++;
+}
+
+static void emit_char(struct rxc *c, int ch)
+{
+	if (ch == '\n')
+		c->re->lines = 0;
+	if ((c->flags & RX_ICASE) && ch < 0x80 && isalpha(ch)) {
+		unsigned char set[32];
+
+		memset(set, 0, sizeof(set));
+		ch |= 0x20;
+		set[ch >> 3] |= 1 << (ch & 7);
+		ch &= ~0x20;
+		set[ch >> 3] |= 1 << (ch & 7);
+		emit(c, OP_CLASS, 0, add_class(c, set), 0);
+		return;
+	}
+	emit(c, OP_CHAR, ch, 0, 0);
+}
+
+// x* is: L1: split L2, L3; L2: x; jmp L1; L3:
+static void star(struct rxc *c, int a)
+{
+	int n = c->re->len - a;
+
+	insert(c, a, OP_SPLIT, 1, n + 2);
+	emit(c, OP_JMP, 0, -(n + 1), 0);
+}
+
+// x\+ is: L1: x; split L1, L2; L2:
+static void plus(struct rxc *c, int a)
+{
+	emit(c, OP_SPLIT, 0, a - c->re->len, 1);
+}
+
+// x\? is: split L1, L2; L1: x; L2:
+static void ques(struct rxc *c, int a)
+{
+	insert(c, a, OP_SPLIT, 1, c->re->len - a + 1);
+}
+
+// x\{m,n\} is m copies of x, then n - m of x\?; with no n, the
+// last copy gets a \+, or is x* if m is 0
+static void repeat(struct rxc *c, int a, int m, int n)
+{
+	struct regex *re = c->re;
+	int len = re->len - a;
+	struct insn *frag;
+	int i, at = a;
+
+	if (m > DUP_MAX || n > DUP_MAX || (n >= 0 && n < m)) {
+		c->err = "invalid \\{\\}";
+		return;
+	}
+	frag = xmalloc(len * sizeof(frag[0]) + 1);
+	memcpy(frag, &re->prog[a], len * sizeof(frag[0]));
+	re->len = a;
+	for (i = 0; i < MAX(m, 1) && !c->err; i++) {
+		at = re->len;
+		while (re->len < at + len && !c->err)
+			emit(c, frag[re->len - at].op, frag[re->len - at].c,
+				frag[re->len - at].x, frag[re->len - at].y);
+	}
+	if (c->err)
+		goto ret;
+	if (n < 0) {
+		if (m == 0)
+			star(c, at);
+		else
+			plus(c, at);
+		goto ret;
+	}
+	if (m == 0) {
+		if (n == 0)
+			re->len = a;
+		else
+			ques(c, at);
+		m = 1;
+	}
+	for (i = m; i < n && !c->err; i++) {
+		at = re->len;
+		while (re->len < at + len && !c->err)
+			emit(c, frag[re->len - at].op, frag[re->len - at].c,
+				frag[re->len - at].x, frag[re->len - at].y);
+		ques(c, at);
+	}
+ ret:
+	free(frag);
+}
+
+// The token at c->p, and where the one after it starts
+static int peek(struct rxc *c, const char **next)
+{
+	const char *p = c->p;
+	int ere = c->flags & RX_EXTENDED;
+	int ch = (unsigned char)*p++;
+
+	*next = p;
+	switch (ch) {
+	case '\0':
+		*next = p - 1;
+		return T_END;
+	case '.':
+		return T_ANY;
+	case '[':
+		return T_BRACKET;
+	case '^':
+		return T_BOL;
+	case '$':
+		return T_EOL;
+	case '*':
+		return T_STAR;
+	case '\\':
+		ch = (unsigned char)*p++;
+		*next = p;
+		if (ch == '\0') {
+			c->err = "trailing backslash";
+			*next = p - 1;
+			return T_END;
+		}
+		if (ch == '<')
+			return T_BOW;
+		if (ch == '>')
+			return T_EOW;
+		if (ch >= '1' && ch <= '9') {
+			c->err = "back references are not supported";
+			return T_END;
+		}
+		if (ere)
+			return ch;
+		break;
+	default:
+		if (!ere)
+			return ch;
+	}
+	switch (ch) {
+	case '(':
+		return T_OPEN;
+	case ')':
+		return T_CLOSE;
+	case '|':
+		return T_ALT;
+	case '+':
+		return T_PLUS;
+	case '?':
+		return T_QUES;
+	case '{':
+		return T_BRACE;
+	}
+	return ch;
+}
+
+static const char class_names[] ALIGN1 =
+	"alpha\0""digit\0""alnum\0""upper\0""lower\0""space\0"
+	"blank\0""punct\0""print\0""graph\0""cntrl\0""xdigit\0";
+
+static int is_class(int i, int ch)
+{
+	switch (i) {
+	case 0: return isalpha(ch);
+	case 1: return isdigit(ch);
+	case 2: return isalnum(ch);
+	case 3: return isupper(ch);
+	case 4: return islower(ch);
+	case 5: return isspace(ch);
+	case 6: return ch == ' ' || ch == '\t';
+	case 7: return ispunct(ch);
+	case 8: return isprint(ch);
+	case 9: return isgraph(ch);
+	case 10: return iscntrl(ch);
+	}
+	return isxdigit(ch);
+}
+
+// [...], c->p is past the '['
+static void parse_bracket(struct rxc *c)
+{
+	unsigned char set[32];
+	const char *p = c->p;
+	int neg = 0, first = 1;
+	int lo, hi;
+
+	memset(set, 0, sizeof(set));
+	if (*p == '^') {
+		neg = 1;
+		p++;
+	}
+	for (;; first = 0) {
+		lo = (unsigned char)*p;
+		if (lo == '\0')
+			goto unmatched;
+		if (lo == ']' && !first) {
+			p++;
+			break;
+		}
+		if (lo == '[' && (p[1] == ':' || p[1] == '=' || p[1] == '.')) {
+			// [:class:], or [=c=] and [.c.] which are just c here
+			const char *e = p + 2;
+			char name[8];
+			int i;
+
+			while (*e && !(e[0] == p[1] && e[1] == ']'))
+				e++;
+			if (*e == '\0')
+				goto unmatched;
+			if (p[1] != ':') {
+				if (e != p + 3)
+					goto bad;
+				lo = (unsigned char)p[2];
+			} else {
+				if (e - (p + 2) >= (int)sizeof(name))
+					goto bad;
+				memcpy(name, p + 2, e - (p + 2));
+				name[e - (p + 2)] = '\0';
+				i = index_in_strings(class_names, name);
+				if (i < 0)
+					goto bad;
+				for (lo = 0; lo < 0x80; lo++)
+					if (is_class(i, lo))
+						set[lo >> 3] |= 1 << (lo & 7);
+				p = e + 2;
+				continue;
+			}
+			p = e + 2;
+		} else {
+			p++;
+		}
+		hi = lo;
+		if (p[0] == '-' && p[1] && p[1] != ']') {
+			hi = (unsigned char)p[1];
+			p += 2;
+			if (hi < lo)
+				goto bad;
+		}
+		for (; lo <= hi; lo++)
+			set[lo >> 3] |= 1 << (lo & 7);
+	}
+	c->p = p;
+	if (c->flags & RX_ICASE) {
+		for (lo = 'A'; lo <= 'Z'; lo++) {
+			hi = lo | 0x20;
+			if (((set[lo >> 3] >> (lo & 7)) | (set[hi >> 3] >> (hi & 7))) & 1) {
+				set[lo >> 3] |= 1 << (lo & 7);
+				set[hi >> 3] |= 1 << (hi & 7);
+			}
+		}
+	}
+	if (neg) {
+		for (lo = 0; lo < 32; lo++)
+			set[lo] = ~set[lo];
+		set['\n' >> 3] &= ~(1 << ('\n' & 7));
+	} else if ((set['\n' >> 3] >> ('\n' & 7)) & 1) {
+		c->re->lines = 0;
+	}
+	emit(c, OP_CLASS, 0, add_class(c, set), 0);
+	return;
+ unmatched:
+	c->err = "unmatched [";
+	return;
+ bad:
+	c->err = "bad [...]";
+}
+
+// The end of a string of chars: keep it if it is the longest
+static void run_end(struct rxc *c)
+{
+	if (c->run_len > c->best_len) {
+		memcpy(c->best, c->run, c->run_len);
+		c->best_len = c->run_len;
+	}
+	c->run_len = 0;
+}
+
+// The operators after the atom at a: how few times it must be there
+static int parse_quant(struct rxc *c, int a)
+{
+	const char *next;
+	int min = -1;	// no operator
+
+	for (;;) {
+		int t = peek(c, &next);
+		int m, n;
+
+		if (t == T_STAR) {
+			star(c, a);
+			m = 0;
+		} else if (t == T_PLUS) {
+			plus(c, a);
+			m = 1;
+		} else if (t == T_QUES) {
+			ques(c, a);
+			m = 0;
+		} else if (t == T_BRACE) {
+			char *e;
+
+			if (!isdigit(*next))
+				goto bad;
+			m = n = strtoul(next, &e, 10);
+			if (*e == ',') {
+				e++;
+				n = -1;
+				if (isdigit(*e))
+					n = strtoul(e, &e, 10);
+			}
+			c->p = e;
+			if (peek(c, &next) != '}')
+				goto bad;
+			c->p = next;
+			repeat(c, a, m, n);
+			next = c->p;
+		} else {
+			return min;
+		}
+		c->p = next;
+		min = min && m;
+		if (c->err)
+			return min;
+	}
+ bad:
+	c->err = "invalid \\{\\}";
+	return min;
+}
+
+static void parse_alt(struct rxc *c);
+
+// A branch: pieces up to a | or ) or the end
+static void parse_seq(struct rxc *c)
+{
+	int ere = c->flags & RX_EXTENDED;
+	int at_start = 1;	// where ^ is special in a BRE
+
+	for (;;) {
+		const char *next;
+		int t = peek(c, &next);
+		int a = c->re->len;	// where the atom's code starts
+		int lit = -1;		// the atom is this char
+		int min;
+
+		if (c->err || t == T_END || t == T_ALT || (t == T_CLOSE && c->depth))
+			return;
+		c->p = next;
+		switch (t) {
+		case T_OPEN: {
+			int n = c->re->nsub++;
+
+			c->depth++;
+			if (n < RX_MAX_SUB)
+				emit(c, OP_SAVE, 2 * n, 0, 0);
+			parse_alt(c);
+			if (c->err)
+				return;
+			if (peek(c, &next) != T_CLOSE) {
+				c->err = ere ? "unmatched (" : "unmatched \\(";
+				return;
+			}
+			c->p = next;
+			c->depth--;
+			if (n < RX_MAX_SUB)
+				emit(c, OP_SAVE, 2 * n + 1, 0, 0);
+			break;
+		}
+		case T_CLOSE:
+			c->err = ere ? "unmatched )" : "unmatched \\)";
+			return;
+		case T_ANY:
+			emit(c, OP_ANY, 0, 0, 0);
+			break;
+		case T_BRACKET:
+			parse_bracket(c);
+			break;
+		case T_BOL:
+			if (!ere && !at_start) {
+				lit = '^';
+				break;
+			}
+			emit(c, OP_BOL, 0, 0, 0);
+			c->plain = 0;
+			// another ^ after it is a char
+			at_start = 0;
+			continue;
+		case T_EOL:
+			t = peek(c, &next);
+			if (!ere && t != T_END && t != T_ALT && t != T_CLOSE) {
+				lit = '$';
+				break;
+			}
+			emit(c, OP_EOL, 0, 0, 0);
+			c->plain = 0;
+			continue;
+		case T_BOW:
+		case T_EOW:
+			emit(c, t == T_BOW ? OP_BOW : OP_EOW, 0, 0, 0);
+			c->plain = 0;
+			at_start = 0;
+			continue;
+		// an operator with nothing to repeat is a char
+		case T_STAR:
+			lit = '*';
+			break;
+		case T_PLUS:
+			lit = '+';
+			break;
+		case T_QUES:
+			lit = '?';
+			break;
+		case T_BRACE:
+			lit = '{';
+			break;
+		default:
+			lit = t;
+		}
+		if (lit >= 0)
+			emit_char(c, lit);
+		at_start = 0;
+		min = parse_quant(c, a);
+		if (c->depth)
+			continue;
+		if (lit < 0 || min == 0) {
+			c->plain = 0;
+			run_end(c);
+			continue;
+		}
+		c->run[c->run_len++] = lit;
+		if (min > 0) {
+			// x\+ is x, and then maybe something else than x
+			c->plain = 0;
+			run_end(c);
+		}
+	}
+}
+
+static void parse_alt(struct rxc *c)
+{
+	int a = c->re->len;
+	const char *next;
+	int j;
+
+	parse_seq(c);
+	if (c->err || peek(c, &next) != T_ALT)
+		return;
+	c->p = next;
+	if (!c->depth)
+		c->alts = 1;
+	// split L1, L2; L1: first branch; jmp L3; L2: the others; L3:
+	insert(c, a, OP_SPLIT, 1, c->re->len - a + 2);
+	j = emit(c, OP_JMP, 0, 0, 0);
+	parse_alt(c);
+	if (!c->err)
+		c->re->prog[j].x = c->re->len - j;
+}
+
+// The chars a match can start with
+static void find_first(struct regex *re)
+{
+	char *seen = xzalloc(re->len);
+	int *st = xmalloc((2 * re->len + 1) * sizeof(st[0]));
+	int n = 0, i, cnt;
+
+	st[n++] = 0;
+	while (n) {
+		int pc = st[--n];
+		const struct insn *in = &re->prog[pc];
+
+		if (seen[pc])
+			continue;
+		seen[pc] = 1;
+		switch (in->op) {
+		case OP_CHAR:
+			re->first[in->c] = 1;
+			break;
+		case OP_ANY:
+			memset(re->first, 1, 256);
+			re->first['\n'] = 0;
+			break;
+		case OP_CLASS:
+			for (i = 0; i < 256; i++)
+				re->first[i] |= (re->cls[in->x][i >> 3] >> (i & 7)) & 1;
+			break;
+		case OP_SPLIT:
+			st[n++] = pc + in->y;
+			/* fall through */
+		case OP_JMP:
+			st[n++] = pc + in->x;
+			break;
+		case OP_MATCH:
+			re->any_first = 1;
+			break;
+		default:	// SAVE and assertions
+			st[n++] = pc + 1;
+		}
+	}
+	free(st);
+	free(seen);
+	re->first_c = -1;
+	for (i = cnt = 0; i < 256; i++) {
+		if (re->first[i]) {
+			re->first_c = i;
+			cnt++;
+		}
+	}
+	if (cnt != 1)
+		re->first_c = -1;
+}
+
+static void vm_alloc(struct regex *re)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		re->l[i].pc = xmalloc(re->len * sizeof(int));
+		re->l[i].sub = xmalloc(re->len * 2 * RX_MAX_SUB * sizeof(char *));
+		re->l[i].mark = xzalloc(re->len * sizeof(unsigned));
+		re->l[i].gen = 0;
+	}
+	re->stack = xmalloc((3 * re->len + 1) * sizeof(re->stack[0]));
+}
+
+struct regex* FAST_FUNC rx_compile(const char *pat, int flags, const char **err)
+{
+	struct rxc c;
+	struct regex *re = xzalloc(sizeof(*re));
+
+	memset(&c, 0, sizeof(c));
+	c.re = re;
+	c.p = pat;
+	c.flags = flags;
+	c.plain = 1;
+	c.run = xmalloc(strlen(pat) + 1);
+	c.best = xmalloc(strlen(pat) + 1);
+	re->nsub = 1;
+	re->lines = 1;
+	emit(&c, OP_SAVE, 0, 0, 0);
+	parse_alt(&c);
+	emit(&c, OP_SAVE, 1, 0, 0);
+	emit(&c, OP_MATCH, 0, 0, 0);
+	run_end(&c);
+	if (c.err) {
+		*err = c.err;
+		rx_free(re);
+		re = NULL;
+		goto ret;
+	}
+	if (!c.alts && c.best_len) {
+		c.best[c.best_len] = '\0';
+		strsearch_init(&re->lit, c.best, flags & RX_ICASE);
+		re->plain = c.plain;
+	}
+	find_first(re);
+	vm_alloc(re);
+ ret:
+	free(c.run);
+	free(c.best);
+	return re;
+}
+
+void FAST_FUNC rx_free(struct regex *re)
+{
+	int i;
+
+	if (!re)
+		return;
+	for (i = 0; i < 2; i++) {
+		free(re->l[i].pc);
+		free(re->l[i].sub);
+		free(re->l[i].mark);
+	}
+	free(re->stack);
+	if (!re->of) {
+		strsearch_free(&re->lit);
+		free(re->cls);
+		free(re->prog);
+	}
+	free(re);
+}
+
+struct regex* FAST_FUNC rx_clone(const struct regex *re)
+{
+	struct regex *cl = xmalloc(sizeof(*cl));
+
+	*cl = *re;
+	cl->of = re;
+	vm_alloc(cl);
+	return cl;
+}
+
+int FAST_FUNC rx_in_lines(const struct regex *re)
+{
+	return re->lines;
+}
+
+//----- Matching -------------------------------------------------------
+
+static int is_word(int ch)
+{
+	return ch >= 0 && ch < 0x80 && (isalnum(ch) || ch == '_');
+}
+
+// Does the assertion op hold at sp?
+static int holds(const struct regex *re, int op, const char *sp)
+{
+	int before = -1, at = -1;	// the chars around sp, if any
+
+	if (sp > re->vs || (re->vflags & RX_TEXT_BEFORE))
+		before = (unsigned char)sp[-1];
+	if (sp < re->vend || (re->vflags & RX_TEXT_AFTER))
+		at = (unsigned char)*sp;
+	switch (op) {
+	case OP_BOL:
+		return before < 0 || before == '\n';
+	case OP_EOL:
+		return at < 0 || at == '\n';
+	case OP_BOW:
+		return !is_word(before) && is_word(at);
+	}
+	return is_word(before) && !is_word(at);
+}
+
+static void new_list(struct vm_list *l, int len)
+{
+	l->n = 0;
+	if (++l->gen == 0) {
+		memset(l->mark, 0, len * sizeof(l->mark[0]));
+		l->gen = 1;
+	}
+}
+
+// Add a thread at pc to l, and the ones it leads to without
+// reading a char, in the order of their priority
+static void add(struct regex *re, struct vm_list *l, int pc, const char **sub, const char *sp)
+{
+	struct vm_stack *st = re->stack;
+	int n = 0;
+
+	st[n].pc = pc;
+	st[n++].slot = -1;
+	while (n) {
+		const struct insn *in;
+
+		n--;
+		if (st[n].slot >= 0) {
+			sub[st[n].slot] = st[n].old;
+			continue;
+		}
+		pc = st[n].pc;
+		if (l->mark[pc] == l->gen)
+			continue;
+		l->mark[pc] = l->gen;
+		in = &re->prog[pc];
+		switch (in->op) {
+		case OP_SPLIT:
+			st[n].pc = pc + in->y;
+			st[n++].slot = -1;
+			/* fall through */
+		case OP_JMP:
+			st[n].pc = pc + in->x;
+			st[n++].slot = -1;
+			break;
+		case OP_SAVE:
+			if (in->c < re->nslot) {
+				st[n].slot = in->c;
+				st[n++].old = sub[in->c];
+				sub[in->c] = sp;
+			}
+			st[n].pc = pc + 1;
+			st[n++].slot = -1;
+			break;
+		case OP_BOL:
+		case OP_EOL:
+		case OP_BOW:
+		case OP_EOW:
+			if (holds(re, in->op, sp)) {
+				st[n].pc = pc + 1;
+				st[n++].slot = -1;
+			}
+			break;
+		default:
+			l->pc[l->n] = pc;
+			memcpy(l->sub + l->n * re->nslot, sub, re->nslot * sizeof(*sub));
+			l->n++;
+		}
+	}
+}
+
+// The first place from sp on where a match can start, or NULL
+static const char *skip(const struct regex *re, const char *sp, const char *end)
+{
+	if (re->any_first)
+		return sp;
+	if (re->first_c >= 0)
+		return memchr(sp, re->first_c, end - sp);
+	while (sp < end && !re->first[(unsigned char)*sp])
+		sp++;
+	return sp < end ? sp : NULL;
+}
+
+// The leftmost-longest match in [s, end), and where its
+// first nslot / 2 groups are in sub[]
+static char *vm_run(struct regex *re, const char *s, const char *end, int flags,
+		const char **sub, int nslot)
+{
+	struct vm_list *cl = &re->l[0], *nl = &re->l[1], *tl;
+	const char *sp = s;
+	int matched = 0;
+	int i;
+
+	re->vs = s;
+	re->vend = end;
+	re->vflags = flags;
+	re->nslot = nslot;
+	new_list(cl, re->len);
+	for (;;) {
+		if (!matched) {
+			// a thread starting here, after all the others
+			if (cl->n == 0) {
+				sp = skip(re, sp, end);
+				if (!sp)
+					break;
+				// pcs marked by the last step, which were
+				// at another sp, are open again
+				new_list(cl, re->len);
+			}
+			memset(re->seed, 0, nslot * sizeof(re->seed[0]));
+			add(re, cl, 0, re->seed, sp);
+		}
+		if (cl->n == 0) {
+			if (matched || sp == end)
+				break;
+			// no thread got past an assertion
+			new_list(cl, re->len);
+			sp++;
+			continue;
+		}
+		new_list(nl, re->len);
+		for (i = 0; i < cl->n; i++) {
+			const struct insn *in = &re->prog[cl->pc[i]];
+			const char **ts = cl->sub + i * nslot;
+			int ch;
+
+			// a match starting further on than the one found
+			// can't be it
+			if (matched && ts[0] > sub[0])
+				continue;
+			if (in->op == OP_MATCH) {
+				if (!matched || ts[0] < sub[0] || ts[1] > sub[1]) {
+					memcpy(sub, ts, nslot * sizeof(*sub));
+					matched = 1;
+				}
+				continue;
+			}
+			if (sp == end)
+				continue;
+			ch = (unsigned char)*sp;
+			if (in->op == OP_CHAR ? ch == in->c
+			 : in->op == OP_ANY ? ch != '\n'
+			 : (re->cls[in->x][ch >> 3] >> (ch & 7)) & 1
+			) {
+				add(re, nl, cl->pc[i] + 1, ts, sp + 1);
+			}
+		}
+		if (sp == end)
+			break;
+		sp++;
+		tl = cl;
+		cl = nl;
+		nl = tl;
+	}
+	return matched ? (char *)sub[0] : NULL;
+}
+
+// Where the match in [s, end) which starts furthest on starts, or NULL,
+// in one pass: a thread started later goes first, and so takes a pc from
+// one started before it, which can't match anything it doesn't
+static const char *vm_last(struct regex *re, const char *s, const char *end, int flags)
+{
+	struct vm_list *cl = &re->l[0], *nl = &re->l[1], *tl;
+	const char *sp = s, *found = NULL;
+	int i;
+
+	re->vs = s;
+	re->vend = end;
+	re->vflags = flags;
+	re->nslot = 2;
+	new_list(cl, re->len);
+	for (;;) {
+		if (cl->n == 0) {
+			sp = skip(re, sp, end);
+			if (!sp)
+				break;
+			new_list(cl, re->len);
+			re->seed[0] = re->seed[1] = NULL;
+			add(re, cl, 0, re->seed, sp);
+			if (cl->n == 0) {
+				// it didn't get past an assertion
+				if (sp == end)
+					break;
+				sp++;
+				continue;
+			}
+		}
+		new_list(nl, re->len);
+		if (sp < end && (re->any_first
+		 || (sp + 1 < end && re->first[(unsigned char)sp[1]]))
+		) {
+			// the one starting at the next char, ahead of the rest
+			re->seed[0] = re->seed[1] = NULL;
+			add(re, nl, 0, re->seed, sp + 1);
+		}
+		for (i = 0; i < cl->n; i++) {
+			const struct insn *in = &re->prog[cl->pc[i]];
+			const char **ts = cl->sub + i * 2;
+			int ch;
+
+			if (in->op == OP_MATCH) {
+				if (!found || ts[0] > found)
+					found = ts[0];
+				continue;
+			}
+			if (sp == end)
+				continue;
+			ch = (unsigned char)*sp;
+			if (in->op == OP_CHAR ? ch == in->c
+			 : in->op == OP_ANY ? ch != '\n'
+			 : (re->cls[in->x][ch >> 3] >> (ch & 7)) & 1
+			) {
+				add(re, nl, cl->pc[i] + 1, ts, sp + 1);
+			}
+		}
+		if (sp == end)
+			break;
+		sp++;
+		tl = cl;
+		cl = nl;
+		nl = tl;
+	}
+	return found;
+}
+
+static int slots(const struct regex *re, int nsub)
+{
+	return 2 * MAX(MIN(nsub, MIN(re->nsub, RX_MAX_SUB)), 1);
+}
+
+char* FAST_FUNC rx_search(struct regex *re, const char *s, const char *end, int flags,
+		const char **sub, int nsub)
+{
+	const char *m[2];
+	int nslot = slots(re, nsub);
+	const char *p = s;
+
+	if (!sub)
+		sub = m;
+	for (nsub *= 2; nsub > nslot;)
+		sub[--nsub] = NULL;
+	if (re->plain) {
+		p = strsearch_fwd(&re->lit, s, end);
+		if (p) {
+			sub[0] = p;
+			sub[1] = p + re->lit.len;
+		}
+		return (char *)p;
+	}
+	if (!re->lit.pat || !re->lines)
+		return vm_run(re, s, end, flags, sub, nslot);
+	// a match is on a line with lit in it
+	for (;;) {
+		const char *q = strsearch_fwd(&re->lit, p, end);
+		const char *ls, *le;
+		int f = flags;
+
+		if (!q)
+			return NULL;
+		ls = memrchr(p, '\n', q - p);
+		ls = ls ? ls + 1 : p;
+		le = memchr(q, '\n', end - q);
+		if (!le)
+			le = end;
+		if (ls > s)
+			f |= RX_TEXT_BEFORE;
+		if (le < end)
+			f |= RX_TEXT_AFTER;
+		q = vm_run(re, ls, le, f, sub, nslot);
+		if (q || le == end)
+			return (char *)q;
+		p = le + 1;
+	}
+}
+
+// The match in [ls, le) which starts furthest on
+static char *last_match(struct regex *re, const char *s, const char *ls, const char *le,
+		const char *end, int flags, const char **sub, int nslot)
+{
+	const char *p;
+
+	if (le < end)
+		flags |= RX_TEXT_AFTER;
+	p = vm_last(re, ls, le, flags | (ls > s ? RX_TEXT_BEFORE : 0));
+	if (!p)
+		return NULL;
+	// and the longest match from there
+	return vm_run(re, p, le, flags | (p > s ? RX_TEXT_BEFORE : 0), sub, nslot);
+}
+
+char* FAST_FUNC rx_search_back(struct regex *re, const char *s, const char *end, int flags,
+		const char **sub, int nsub)
+{
+	const char *m[2];
+	int nslot = slots(re, nsub);
+	const char *le = end;
+
+	if (!sub)
+		sub = m;
+	for (nsub *= 2; nsub > nslot;)
+		sub[--nsub] = NULL;
+	if (re->plain) {
+		const char *p = strsearch_back(&re->lit, s, end);
+
+		if (p) {
+			sub[0] = p;
+			sub[1] = p + re->lit.len;
+		}
+		return (char *)p;
+	}
+	if (!re->lines)
+		return last_match(re, s, s, end, end, flags, sub, nslot);
+	// line by line, skipping those without lit
+	for (;;) {
+		const char *ls, *p;
+
+		if (re->lit.pat) {
+			p = strsearch_back(&re->lit, s, le);
+			if (!p)
+				return NULL;
+			le = memchr(p, '\n', le - p) ?: le;
+		} else {
+			p = le;
+		}
+		ls = memrchr(s, '\n', p - s);
+		ls = ls ? ls + 1 : s;
+		p = last_match(re, s, ls, le, end, flags, sub, nslot);
+		if (p || ls == s)
+			return (char *)p;
+		le = ls - 1;
+	}
+}
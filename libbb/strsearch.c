@@ -0,0 +1,200 @@
+/* vi: set sw=4 ts=4: */
+/*
+ * Substring search: a pattern is prepared once, then searched for
+ * forward or backward as often as needed. Letters can match either
+ * case: only ASCII ones, as strncasecmp() in the C locale.
+ *
+ * Licensed under GPLv2, see file LICENSE in this source tree.
+ */
+#include "libbb.h"
+
+#define ONES	((unsigned long)-1 / 0xff)	// 0x0101...
+#define HIGHS	(ONES * 0x80)
+
+// Longer patterns are searched for with Horspool's skips, shorter
+// ones a word of text at a time
+#define LONG_PAT (4 * (int)sizeof(long))
+
+// High bit set in each byte of x which is zero, and maybe in some
+// above one: a filter, the candidates it lets through are checked
+static unsigned long zero_bytes(unsigned long x)
+{
+	return (x - ONES) & ~x & HIGHS;
+}
+
+static unsigned fold(unsigned c)
+{
+	return c - 'A' < 26 ? c | 0x20 : c;
+}
+
+// x with the upper case letters in it made lower case
+static unsigned long fold_word(unsigned long x)
+{
+	unsigned long h = x & ~HIGHS;
+	// high bit set in the bytes 'A'..'Z'
+	unsigned long upper = ((h + ONES * (0x80 - 'A')) ^ (h + ONES * (0x80 - 'Z' - 1))) & ~x & HIGHS;
+
+	return x | upper >> 2;
+}
+
+// What to OR a word of text with before looking for c in it
+static unsigned long fold_mask(const struct strsearch *ss, unsigned c)
+{
+	return ss->icase && c - 'a' < 26 ? ONES * 0x20 : 0;
+}
+
+// Does the text at q match the pattern?
+static int same(const struct strsearch *ss, const unsigned char *q)
+{
+	const char *pat = ss->key;
+	int n = ss->len;
+
+	if (!ss->icase)
+		return memcmp(q, pat, n) == 0;
+	for (; n >= (int)sizeof(long); n -= sizeof(long)) {
+		unsigned long x, y;
+
+		memcpy(&x, q, sizeof(x));
+		memcpy(&y, pat, sizeof(y));
+		if (fold_word(x) != y)
+			return 0;
+		q += sizeof(long);
+		pat += sizeof(long);
+	}
+	for (; n > 0; n--)
+		if (fold(*q++) != (unsigned char)*pat++)
+			return 0;
+	return 1;
+}
+
+void FAST_FUNC strsearch_init(struct strsearch *ss, const char *pat, int icase)
+{
+	int i, n = strlen(pat);
+
+	strsearch_free(ss);
+	ss->pat = ss->key = xstrdup(pat);
+	ss->len = n;
+	ss->icase = icase;
+	for (i = 0; i < 256; i++)
+		ss->shift[i] = ss->rshift[i] = n;
+	// a text byte under the pattern's last (first) char moves it
+	// on to the nearest same char in it, or past it
+	for (i = 0; i < n - 1; i++)
+		ss->shift[(unsigned char)pat[i]] = n - 1 - i;
+	for (i = n - 1; i > 0; i--)
+		ss->rshift[(unsigned char)pat[i]] = i;
+	if (icase) {
+		ss->key = xstrdup(pat);
+		for (i = 0; i < n; i++)
+			ss->key[i] = fold(pat[i]);
+		for (i = 'a'; i <= 'z'; i++) {
+			ss->shift[i] = ss->shift[i - 0x20] = MIN(ss->shift[i], ss->shift[i - 0x20]);
+			ss->rshift[i] = ss->rshift[i - 0x20] = MIN(ss->rshift[i], ss->rshift[i - 0x20]);
+		}
+	}
+}
+
+void FAST_FUNC strsearch_free(struct strsearch *ss)
+{
+	if (ss->key != ss->pat)
+		free(ss->key);
+	free(ss->pat);
+	ss->pat = ss->key = NULL;
+}
+
+/* First match which is all in [p, end) */
+char* FAST_FUNC strsearch_fwd(const struct strsearch *ss, const char *p, const char *end)
+{
+	const unsigned char *q = (const unsigned char *)p;
+	const unsigned char *pat = (const unsigned char *)ss->key;
+	const unsigned char *last;	// where the last match could start
+	int n = ss->len, n1 = n - 1;
+
+	if (n == 0)
+		return (char *)p;
+	if (end - p < n)
+		return NULL;
+	last = (const unsigned char *)end - n;
+	if (n >= LONG_PAT) {
+		while (q <= last) {
+			unsigned c = q[n1];
+			if (same(ss, q))
+				return (char *)q;
+			q += ss->shift[c];
+		}
+		return NULL;
+	}
+	if (n > 1 || ss->icase) {
+		// the positions where both the first and the last char
+		// of the pattern are, sizeof(long) at a time
+		unsigned long f = ONES * pat[0], l = ONES * pat[n1];
+		unsigned long fm = fold_mask(ss, pat[0]), lm = fold_mask(ss, pat[n1]);
+
+		for (; q + sizeof(long) - 1 <= last; q += sizeof(long)) {
+			unsigned long x, y;
+			int k;
+
+			memcpy(&x, q, sizeof(x));
+			memcpy(&y, q + n1, sizeof(y));
+			if (!(zero_bytes((x | fm) ^ f) & zero_bytes((y | lm) ^ l)))
+				continue;
+			for (k = 0; k < (int)sizeof(long); k++)
+				if (same(ss, q + k))
+					return (char *)q + k;
+		}
+		for (; q <= last; q++)
+			if (same(ss, q))
+				return (char *)q;
+		return NULL;
+	}
+	return memchr(p, pat[0], end - p);
+}
+
+/* Last match which is all in [start, end) */
+char* FAST_FUNC strsearch_back(const struct strsearch *ss, const char *start, const char *end)
+{
+	const unsigned char *first = (const unsigned char *)start;
+	const unsigned char *pat = (const unsigned char *)ss->key;
+	const unsigned char *q;
+	int n = ss->len, n1 = n - 1;
+
+	if (n == 0)
+		return (char *)end;
+	if (end - start < n)
+		return NULL;
+	q = (const unsigned char *)end - n;	// where the last match could start
+	if (n >= LONG_PAT) {
+		for (;;) {
+			unsigned c = q[0];
+			if (same(ss, q))
+				return (char *)q;
+			if (q - first < ss->rshift[c])
+				return NULL;
+			q -= ss->rshift[c];
+		}
+	}
+	if (n > 1 || ss->icase) {
+		unsigned long f = ONES * pat[0], l = ONES * pat[n1];
+		unsigned long fm = fold_mask(ss, pat[0]), lm = fold_mask(ss, pat[n1]);
+
+		// q is the highest start not looked at yet
+		for (; q - first >= (int)sizeof(long) - 1; q -= sizeof(long)) {
+			const unsigned char *b = q - (sizeof(long) - 1);
+			unsigned long x, y;
+			int k;
+
+			memcpy(&x, b, sizeof(x));
+			memcpy(&y, b + n1, sizeof(y));
+			if (!(zero_bytes((x | fm) ^ f) & zero_bytes((y | lm) ^ l)))
+				continue;
+			for (k = sizeof(long) - 1; k >= 0; k--)
+				if (same(ss, b + k))
+					return (char *)b + k;
+		}
+		for (; q >= first; q--)
+			if (same(ss, q))
+				return (char *)q;
+		return NULL;
+	}
+	return memrchr(start, pat[0], end - start);
+}
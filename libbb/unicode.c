@@ -0,0 +1,178 @@
+/* vi: set sw=4 ts=4: */
+/*
+ * UTF-8 helpers: locale check, decoding and display width.
+ *
+ * Licensed under GPLv2, see file LICENSE in this source tree.
+ */
+#include "libbb.h"
+
+/* Is the user's locale a UTF-8 one? Checked like setlocale() would
+ * pick it, without pulling in the locale machinery. */
+int FAST_FUNC utf8_locale(void)
+{
+	static const char *const vars[] = { "LC_ALL", "LC_CTYPE", "LANG" };
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(vars); i++) {
+		const char *s = getenv(vars[i]);
+		if (s && s[0])
+			return strcasestr(s, "UTF-8") || strcasestr(s, "utf8");
+	}
+	return 0;
+}
+
+/* Decode the char at s, not reading at or past 'end'. Returns its
+ * length in bytes and sets *wc, or returns 0 for a malformed,
+ * overlong or surrogate sequence. */
+int FAST_FUNC utf8_decode(const char *s, const char *end, unsigned *wc)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	unsigned c = *p;
+	int i, n;
+
+	if (c < 0x80) {
+		*wc = c;
+		return 1;
+	}
+	if (c < 0xc2)		// continuation byte, or overlong lead
+		return 0;
+	n = (c < 0xe0) ? 2 : (c < 0xf0) ? 3 : (c < 0xf5) ? 4 : 0;
+	if (n == 0 || end - s < n)
+		return 0;
+	c &= 0x3f >> (n - 1);
+	for (i = 1; i < n; i++) {
+		if ((p[i] & 0xc0) != 0x80)
+			return 0;
+		c = (c << 6) | (p[i] & 0x3f);
+	}
+	if ((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10ffff))
+	 || (c >= 0xd800 && c <= 0xdfff)
+	) {
+		return 0;
+	}
+	*wc = c;
+	return n;
+}
+
+/* Store wc as UTF-8 in buf[4], return the length */
+int FAST_FUNC utf8_encode(char *buf, unsigned wc)
+{
+	unsigned char *p = (unsigned char *)buf;
+
+	if (wc < 0x80) {
+		p[0] = wc;
+		return 1;
+	}
+	if (wc < 0x800) {
+		p[0] = 0xc0 | (wc >> 6);
+		p[1] = 0x80 | (wc & 0x3f);
+		return 2;
+	}
+	if (wc < 0x10000) {
+		p[0] = 0xe0 | (wc >> 12);
+		p[1] = 0x80 | ((wc >> 6) & 0x3f);
+		p[2] = 0x80 | (wc & 0x3f);
+		return 3;
+	}
+	p[0] = 0xf0 | (wc >> 18);
+	p[1] = 0x80 | ((wc >> 12) & 0x3f);
+	p[2] = 0x80 | ((wc >> 6) & 0x3f);
+	p[3] = 0x80 | (wc & 0x3f);
+	return 4;
+}
+
+/* Ranges of chars which take no column (combining marks, zero width
+ * spaces) or two (East Asian wide and fullwidth), sorted. */
+static const uint32_t zero_width[][2] = {
+	{ 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd },
+	{ 0x05bf, 0x05c7 }, { 0x0610, 0x061a }, { 0x064b, 0x065f },
+	{ 0x0670, 0x0670 }, { 0x06d6, 0x06ed }, { 0x0711, 0x0711 },
+	{ 0x0730, 0x074a }, { 0x07a6, 0x07b0 }, { 0x0901, 0x0903 },
+	{ 0x093c, 0x094d }, { 0x0951, 0x0954 }, { 0x0962, 0x0963 },
+	{ 0x0981, 0x0983 }, { 0x09bc, 0x09cd }, { 0x0a01, 0x0a03 },
+	{ 0x0a3c, 0x0a4d }, { 0x0a81, 0x0a83 }, { 0x0abc, 0x0acd },
+	{ 0x0b01, 0x0b03 }, { 0x0b3c, 0x0b4d }, { 0x0bbe, 0x0bcd },
+	{ 0x0c3e, 0x0c56 }, { 0x0cbc, 0x0ccd }, { 0x0d3e, 0x0d4d },
+	{ 0x0e31, 0x0e31 }, { 0x0e34, 0x0e3a }, { 0x0e47, 0x0e4e },
+	{ 0x0eb1, 0x0eb1 }, { 0x0eb4, 0x0ebc }, { 0x0ec8, 0x0ecd },
+	{ 0x0f18, 0x0f19 }, { 0x0f71, 0x0f84 }, { 0x102d, 0x1039 },
+	{ 0x1160, 0x11ff }, { 0x135f, 0x135f }, { 0x1712, 0x1714 },
+	{ 0x17b4, 0x17d3 }, { 0x180b, 0x180d }, { 0x1a17, 0x1a1b },
+	{ 0x1dc0, 0x1dff }, { 0x200b, 0x200f }, { 0x202a, 0x202e },
+	{ 0x2060, 0x2064 }, { 0x20d0, 0x20f0 }, { 0x302a, 0x302f },
+	{ 0x3099, 0x309a }, { 0xfe00, 0xfe0f }, { 0xfe20, 0xfe2f },
+	{ 0xfeff, 0xfeff }, { 0x1d167, 0x1d169 }, { 0x1d173, 0x1d182 },
+	{ 0xe0001, 0xe007f }, { 0xe0100, 0xe01ef },
+};
+static const uint32_t double_width[][2] = {
+	{ 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x2329, 0x232a },
+	{ 0x23e9, 0x23ec }, { 0x25fd, 0x25fe }, { 0x2614, 0x2615 },
+	{ 0x2648, 0x2653 }, { 0x26aa, 0x26ab }, { 0x26bd, 0x26be },
+	{ 0x26c4, 0x26c5 }, { 0x26f2, 0x26f5 }, { 0x2705, 0x2705 },
+	{ 0x270a, 0x270b }, { 0x2728, 0x2728 }, { 0x274c, 0x274c },
+	{ 0x2753, 0x2757 }, { 0x2795, 0x2797 }, { 0x27b0, 0x27b0 },
+	{ 0x2b1b, 0x2b1c }, { 0x2e80, 0x303e }, { 0x3041, 0x3247 },
+	{ 0x3250, 0x4dbf }, { 0x4e00, 0xa4cf }, { 0xa960, 0xa97f },
+	{ 0xac00, 0xd7a3 }, { 0xf900, 0xfaff }, { 0xfe10, 0xfe19 },
+	{ 0xfe30, 0xfe6f }, { 0xff00, 0xff60 }, { 0xffe0, 0xffe6 },
+	{ 0x16fe0, 0x18aff }, { 0x1b000, 0x1b2ff }, { 0x1f004, 0x1f004 },
+	{ 0x1f0cf, 0x1f0cf }, { 0x1f18e, 0x1f18e }, { 0x1f191, 0x1f19a },
+	{ 0x1f200, 0x1f251 }, { 0x1f300, 0x1f64f }, { 0x1f680, 0x1f6ff },
+	{ 0x1f7e0, 0x1f7eb }, { 0x1f90c, 0x1f9ff }, { 0x1fa70, 0x1faff },
+	{ 0x20000, 0x2fffd }, { 0x30000, 0x3fffd },
+};
+
+static int in_table(const uint32_t (*t)[2], int n, unsigned wc)
+{
+	int lo = 0, hi = n - 1;
+
+	if (wc < t[0][0] || wc > t[hi][1])
+		return 0;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (wc > t[mid][1])
+			lo = mid + 1;
+		else if (wc < t[mid][0])
+			hi = mid - 1;
+		else
+			return 1;
+	}
+	return 0;
+}
+
+/* Columns taken by a printable char wc >= 0xa0 */
+int FAST_FUNC unicode_width(unsigned wc)
+{
+	// most text is below the first combining mark
+	if (wc < 0x300)
+		return 1;
+	if (in_table(zero_width, ARRAY_SIZE(zero_width), wc))
+		return 0;
+	if (wc >= 0x1100 && in_table(double_width, ARRAY_SIZE(double_width), wc))
+		return 2;
+	return 1;
+}
+
+/* Length of the run of printable ASCII (' '..'~') at s, up to n.
+ * A word is tested at a time: a byte stops the run if its top bit
+ * is set, if it is below ' ', or if it is 0x7f. */
+size_t FAST_FUNC printable_ascii_len(const char *s, size_t n)
+{
+	const unsigned long ones = (unsigned long)-1 / 0xff;	// 0x0101...
+	const unsigned long highs = ones * 0x80;
+	size_t i = 0;
+
+	for (; i + sizeof(long) <= n; i += sizeof(long)) {
+		unsigned long x;
+
+		memcpy(&x, s + i, sizeof(x));
+		if (((x | ((x - ones * ' ') & ~x)) & highs)	// >= 0x80, < ' '
+		 || (((x ^ (ones * 0x7f)) - ones) & ~(x ^ (ones * 0x7f)) & highs) // 0x7f
+		) {
+			break;
+		}
+	}
+	while (i < n && (unsigned char)(s[i] - ' ') < 0x7f - ' ')
+		i++;
+	return i;
+}
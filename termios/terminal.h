@@ -19,6 +19,7 @@
 
 enum {
 	MAX_TABSTOP = 32, // sanity limit
+	MAX_GUTTER = 12,  // line number column: 10 digits and a blank
 	// User input len. Need not be extra big.
 	// Lines in file being edited *can* be bigger than this.
 	MAX_INPUT_LEN = 128,
@@ -27,6 +28,17 @@ enum {
 	MAX_SCR_ROWS = CONFIG_FEATURE_VI_MAX_LEN,
 };
 
+// Attributes of screen cells, see set_attr()
+enum {
+	ATTR_NORMAL = 0,
+	ATTR_STANDOUT,
+	ATTR_SEARCH,    // hlsearch match
+	ATTR_COMMENT,   // syntax highlighting
+	ATTR_CONSTANT,
+	ATTR_KEYWORD,
+	ATTR_PREPROC,
+};
+
 /* "Keycodes" that report an escape sequence.
  * We use something which fits into signed char,
  * yet doesn't represent any valid Unicode character.
@@ -44,6 +56,7 @@ enum {
     KEYCODE_PAGEDOWN = -11,
     KEYCODE_BACKSPACE = -12, /* Used only if Alt/Ctrl/Shifted */
     KEYCODE_D = -13,         /* Used only if Alted */
+    KEYCODE_PASTE = -14,     /* Bracketed paste, see read_paste() */
 #if 0
 	KEYCODE_FUN1      = ,
 	KEYCODE_FUN2      = ,
@@ -87,6 +100,20 @@ struct term {
 	int get_rowcol_error;
 #endif
 	struct termios term_orig; // remember what the cooked mode was
+	smallint has_rep;	// terminal knows REP (repeat last char)
+	smallint has_sync;	// and synchronized output (mode 2026)
+#if ENABLE_FEATURE_VI_TERM_PROBE
+	smallint probe;		// PROBE_xxx, asking what it can do
+#endif
+	smallint attr;		// ATTR_xxx the terminal is drawing with
+	smallint raw;		// rawmode() is on
+	smallint want_kitty;	// kitty keyboard protocol is asked for
+	smallint kitty;		// KITTY_xxx, and whether it is on
+	int esc_timeout;	// ms to wait for the rest of an ESC sequence
+#if ENABLE_FEATURE_VI_STATS
+	unsigned long keys;	// read from the terminal
+	unsigned long syscalls;	// made to read and draw them
+#endif
 	// Should be just enough to hold a key sequence,
 	// but CRASHME mode uses it as generated command buffer too
 #if ENABLE_FEATURE_VI_CRASHME
@@ -101,27 +128,48 @@ extern struct term T;
 #define columns                 (T.columns            )
 #define term_orig               (T.term_orig          )
 #define readbuffer              (T.readbuffer         )
+#define esc_timeout             (T.esc_timeout        )
 
 #define isbackspace(c)	((c) == term_orig.c_cc[VERASE] || (c) == 8 || (c) == 127)
 
 // xtermios.c
 int64_t read_key(int fd, char *buffer, int timeout) FAST_FUNC;
 int64_t safe_read_key(int fd, char *buffer, int timeout) FAST_FUNC;
+char *read_paste(int fd, char *buffer, int *lenp) FAST_FUNC;
+char *read_burst(int fd, char *buffer, int *lenp) FAST_FUNC;
+#if ENABLE_FEATURE_VI_READER_THREAD
+void interrupt_keys(void) FAST_FUNC;
+int interrupted(void) FAST_FUNC;
+int interrupt_key(void) FAST_FUNC;
+#else
+# define interrupted() 0
+# define interrupt_key() 0
+#endif
 void show_help(void) FAST_FUNC;
 void write1(const char *out) FAST_FUNC;
 int query_screen_dimensions(void) FAST_FUNC;
 int mysleep(int hund) FAST_FUNC;
+int tty_baud(void) FAST_FUNC;
+int output_backlog(void) FAST_FUNC;
+int slow_tty(void) FAST_FUNC;
 void rawmode(void) FAST_FUNC;
+void kitty_keys(int on) FAST_FUNC;
 void cookmode(void) FAST_FUNC;
 void place_cursor(int row, int col) FAST_FUNC;
 void clear_to_eol(void) FAST_FUNC;
+void write_span(const char *s, int len, int to_eol) FAST_FUNC;
 void home_and_clear_to_eos(void) FAST_FUNC;
 void go_bottom_and_clear_to_eol(void) FAST_FUNC;
+void set_attr(int attr) FAST_FUNC;
 void standout_start(void) FAST_FUNC;
 void standout_end(void) FAST_FUNC;
 void bell(void) FAST_FUNC;
+void sync_output(int on) FAST_FUNC;
 void init_term(void) FAST_FUNC;
+void cursor_report(int64_t k) FAST_FUNC;
 void alternate_screen_buffer_start(void) FAST_FUNC;
 void alternate_screen_buffer_end(void) FAST_FUNC;
+void reverse_video_start(void) FAST_FUNC;
+void reverse_video_end(void) FAST_FUNC;
 
 #endif
@@ -11,18 +11,25 @@
 #include "libbb.h"
 #include "platform.h"
 #include "terminal.h"
+#if ENABLE_FEATURE_VI_WRITER_THREAD || ENABLE_FEATURE_VI_READER_THREAD
+# include <pthread.h>
+# include <semaphore.h>
+#endif
 
 // VT102 ESC sequences.
 // See "Xterm Control Sequences"
 // http://invisible-island.net/xterm/ctlseqs/ctlseqs.html
 #define ESC "\033"
-// Inverse/Normal text
-#define ESC_BOLD_TEXT ESC"[7m"
+// Normal text
 #define ESC_NORM_TEXT ESC"[m"
 // Bell
 #define ESC_BELL "\007"
 // Clear-to-end-of-line
 #define ESC_CLEAR2EOL ESC"[K"
+// Erase <num> chars (cursor does not move)
+#define ESC_ERASE_CHARS ESC"[%uX"
+// Repeat preceding char <num> times
+#define ESC_REPEAT_CHAR ESC"[%ub"
 // Clear-to-end-of-screen.
 // (We use default param here.
 // Full sequence is "ESC [ <num> J",
@@ -44,6 +51,19 @@
 
 struct term T;
 
+#if ENABLE_FEATURE_VI_STATS
+// system calls made for the terminal, from any thread: see :stats
+# define COUNT_SYSCALL() __atomic_fetch_add(&T.syscalls, 1, __ATOMIC_RELAXED)
+#else
+# define COUNT_SYSCALL() ((void)0)
+#endif
+
+// What the terminal answers is picked up by read_key(), which may
+// run on the reader thread: T.has_rep, .has_sync, .probe and .kitty
+// are set there and looked at by the editor and the writer
+#define T_GET(f) __atomic_load_n(&T.f, __ATOMIC_ACQUIRE)
+#define T_SET(f, v) __atomic_store_n(&T.f, (v), __ATOMIC_RELEASE)
+
 static int wh_helper(int value, int def_val, const char *env_name, int *err) {
     /* Envvars override even if "value" from ioctl is valid (>0).
 	 * Rationale: it's impossible to guess what user wants.
@@ -93,6 +113,7 @@ static int FAST_FUNC get_terminal_width_height(int fd, int *width, int *height)
     win.ws_col = 0;
     /* I've seen ioctl returning 0, but row/col is (still?) 0.
 	 * We treat that as an error too.  */
+    COUNT_SYSCALL();
     err = ioctl(fd, TIOCGWINSZ, &win) != 0 || win.ws_row == 0;
     if (height)
         *height = wh_helper(win.ws_row, 24, "LINES", &err);
@@ -188,7 +209,10 @@ static int FAST_FUNC set_termios_to_raw(int fd, struct termios *oldterm, int fla
  * Warning! May take longer than timeout_ms to return! */
 int FAST_FUNC safe_poll(struct pollfd *ufds, nfds_t nfds, int timeout) {
     while (1) {
-        int n = poll(ufds, nfds, timeout);
+        int n;
+
+        COUNT_SYSCALL();
+        n = poll(ufds, nfds, timeout);
         if (n >= 0)
             return n;
         /* Make sure we inch towards completion */
@@ -206,10 +230,287 @@ int FAST_FUNC safe_poll(struct pollfd *ufds, nfds_t nfds, int timeout) {
     }
 }
 
+// Input read from stdin but not yet decoded. read_key() takes from
+// here, and refills it with all the terminal has sent in one read,
+// so that an escape sequence or typeahead costs no more system calls.
+// read_burst() and the reader thread put their own buffers here.
+enum { AHEAD_CHUNK = 4096 };
+static char *ahead;
+static int ahead_len, ahead_pos, ahead_size;
+#if !ENABLE_FEATURE_VI_READER_THREAD
+static unsigned drained_ms;	// when a read last took all there was
+#endif
+
+static int key_poll(struct pollfd *pfd, int timeout)
+{
+	if (ahead_pos < ahead_len)
+		return 1;
+	return safe_poll(pfd, 1, timeout);
+}
+
+static ssize_t key_read(int fd, char *c)
+{
+	if (ahead_pos == ahead_len) {
+		ssize_t n;
+
+		if (ahead_size < AHEAD_CHUNK) {
+			free(ahead);
+			ahead = xmalloc(AHEAD_CHUNK);
+			ahead_size = AHEAD_CHUNK;
+		}
+		COUNT_SYSCALL();
+		n = safe_read(fd, ahead, ahead_size);
+		if (n <= 0)
+			return n;
+#if !ENABLE_FEATURE_VI_READER_THREAD
+		drained_ms = n < ahead_size ? (unsigned)monotonic_ms() : 0;
+#endif
+		ahead_len = n;
+		ahead_pos = 0;
+	}
+	*c = ahead[ahead_pos++];
+	return 1;
+}
+
+#if ENABLE_FEATURE_VI_TERM_PROBE
+// What the terminal can do is asked once, with queries for its
+// version (XTVERSION), for synchronized output (DECRQM 2026) and
+// last for the device attributes (DA1), which every terminal answers.
+// The answers come in along with the keys and are picked up by
+// read_key(), so nothing waits for them. The result is kept in
+// ~/.cache/vi_term, keyed by $TERM and $TERM_PROGRAM[_VERSION],
+// so that the next start needn't ask.
+enum {
+	PROBE_NONE = 0,
+	PROBE_SENT,	// waiting for the DA1 answer
+	PROBE_DONE,
+};
+static char term_version[40];	// name(version) from XTVERSION
+
+static char *probe_cache_key(void)
+{
+	const char *term = getenv("TERM");
+	const char *prog = getenv("TERM_PROGRAM");
+	const char *ver = getenv("TERM_PROGRAM_VERSION");
+
+	return xasprintf("%s/%s/%s", term ?: "", prog ?: "", ver ?: "");
+}
+
+static char *probe_cache_file(void)
+{
+	const char *home = getenv("HOME");
+
+	return home ? concat_path_file(home, ".cache/vi_term") : NULL;
+}
+
+// Lines are "KEY FLAGS VERSION", FLAGS has 'r' for REP,
+// 's' for synchronized output, '-' for neither
+static int probe_cached(void)
+{
+	char *file = probe_cache_file();
+	char *key = probe_cache_key();
+	size_t len = strlen(key);
+	char *buf, *line;
+	int found = 0;
+
+	buf = file ? xmalloc_open_read_close(file, NULL) : NULL;
+	for (line = buf; line && *line; line = strchrnul(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (strncmp(line, key, len) == 0 && line[len] == ' ') {
+			const char *f;
+			int rep = 0, sync = 0;
+
+			for (f = line + len + 1; *f && !isspace(*f); f++) {
+				if (*f == 'r')
+					rep = 1;
+				if (*f == 's')
+					sync = 1;
+			}
+			T_SET(has_rep, rep);
+			T_SET(has_sync, sync);
+			found = 1;
+			break;
+		}
+	}
+	free(buf);
+	free(key);
+	free(file);
+	return found;
+}
+
+static void probe_save(void)
+{
+	char *file = probe_cache_file();
+	char *key = probe_cache_key();
+	char *line;
+	int fd;
+
+	fd = file ? open(file, O_WRONLY | O_CREAT | O_APPEND, 0644) : -1;
+	if (fd >= 0) {
+		line = xasprintf("%s %s%s%s %s\n", key,
+				T_GET(has_rep) ? "r" : "", T_GET(has_sync) ? "s" : "",
+				T_GET(has_rep) || T_GET(has_sync) ? "" : "-", term_version);
+		full_write(fd, line, strlen(line));
+		close(fd);
+		free(line);
+	}
+	free(key);
+	free(file);
+}
+
+// send the queries, unless the answers are known already
+static void probe_terminal(const char *term)
+{
+	if (T_GET(probe) != PROBE_NONE)
+		return;
+	T_SET(probe, PROBE_DONE);
+	// until we know better: REP is ECMA-48,
+	// but VTxxx and the Linux console don't have it
+	T_SET(has_rep, term && strncmp(term, "xterm", 5) == 0);
+	if (probe_cached())
+		return;
+	T_SET(probe, PROBE_SENT);
+	write1(ESC"[>0q" ESC"[?2026$p" ESC"[c");
+}
+
+// "ESC [ ..." answer to a probe, the final byte is in buf[n - 1]
+static void csi_reply(const char *buf, int n)
+{
+	if (T_GET(probe) != PROBE_SENT || buf[1] != '?')
+		return;
+	if (buf[n - 1] == 'c') {
+		// DA1 comes last: we've heard all there is to hear
+		T_SET(probe, PROBE_DONE);
+		probe_save();
+	} else if (n > 3 && buf[n - 2] == '$' && buf[n - 1] == 'y') {
+		// DECRPM: "? 2026 ; Ps $ y", Ps 1 = set, 2 = reset
+		char *end;
+
+		if (strtoul(buf + 2, &end, 10) == 2026 && *end == ';')
+			T_SET(has_sync, end[1] == '1' || end[1] == '2');
+	}
+}
+
+// Read a DCS string up to its ST, the XTVERSION answer is ">|NAME"
+static void read_dcs(struct pollfd *pfd)
+{
+	// terminals which are known to have REP
+	static const char rep_terms[] ALIGN1 =
+		"xterm\0" "tmux\0" "kitty\0" "foot\0" "WezTerm\0";
+	char str[sizeof(term_version) + 2];
+	unsigned len = 0;
+	char c, prev = 0;
+
+	while (key_poll(pfd, 50) > 0 && key_read(pfd->fd, &c) == 1) {
+		if (c == '\a' || (prev == 27 && c == '\\'))
+			break;
+		if (c != 27 && len < sizeof(str) - 1)
+			str[len++] = c;
+		prev = c;
+	}
+	str[len] = '\0';
+	if (T_GET(probe) == PROBE_SENT && str[0] == '>' && str[1] == '|') {
+		const char *name;
+		int rep = 0;
+
+		strcpy(term_version, str + 2);
+		for (name = rep_terms; *name; name += strlen(name) + 1) {
+			if (strncmp(term_version, name, strlen(name)) == 0)
+				rep = 1;
+		}
+		T_SET(has_rep, rep);
+	}
+}
+#endif
+
+// The kitty keyboard protocol, level 1 ("disambiguate escape codes"):
+// Esc, and keys with Alt or Ctrl, come as "ESC [ code ; mods u".
+// Then a lone ESC is always the start of a sequence, and read_key()
+// needn't time out waiting for the rest of it.
+enum {
+	KITTY_OFF = 0,
+	KITTY_ASKED,	// mode pushed, waiting for the "ESC [ ? flags u" answer
+	KITTY_ON,
+};
+
+static void kitty_mode(int on)
+{
+	if (!on == !T_GET(kitty))
+		return;
+	if (on) {
+		// set before asking, the answer may come at once
+		T_SET(kitty, KITTY_ASKED);
+		// a terminal which doesn't know the mode doesn't answer
+		write1(ESC"[>1u" ESC"[?u");
+	} else {
+		T_SET(kitty, KITTY_OFF);
+		write1(ESC"[<u");
+	}
+}
+
+void FAST_FUNC kitty_keys(int on)
+{
+	T.want_kitty = on;
+	if (T.raw)
+		kitty_mode(on);
+}
+
+// "ESC [ code [: alternates] [; mods] u", the final byte in buf[n - 1]:
+// the key, with what follows it left in buf[], or -1 if it isn't one
+static int csi_u(char *buf, int n)
+{
+	char *end, key[4];
+	unsigned code, mods = 0;
+	int len;
+
+	if (buf[n - 1] != 'u')
+		return -1;
+	if (buf[1] == '?') {
+		smallint asked = KITTY_ASKED;
+
+		// only if it wasn't turned off meanwhile
+		if (strtoul(buf + 2, NULL, 10) & 1)
+			__atomic_compare_exchange_n(&T.kitty, &asked, KITTY_ON, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+		return -1;
+	}
+	code = strtoul(buf + 1, &end, 10);
+	while (*end == ':' || isdigit(*end))
+		end++;
+	if (*end == ';')
+		mods = strtoul(end + 1, NULL, 10) - 1; // 1 shift, 2 alt, 4 ctrl
+	if (code == 0 || code > 0x10ffff || (code >= 0xe000 && code <= 0xf8ff))
+		return -1; // keypad and such, in the private use area
+	if ((mods & 1) && code >= 'a' && code <= 'z')
+		code -= 'a' - 'A';
+	if ((mods & 4) && code >= '@' && code < 0x7f)
+		code &= 0x1f;
+	else if ((mods & 4) && code == ' ')
+		code = 0;
+#if ENABLE_FEATURE_VI_READER_THREAD
+	if (code == 3 && !(mods & 2)) {
+		// Ctrl-C, which the tty doesn't make a SIGINT of now
+		interrupt_keys();
+		return -1;
+	}
+#endif
+	len = utf8_encode(key, code);
+	if (mods & 2) {
+		// Alt-x: ESC x, as terminals used to send it
+		memcpy(buf, key, len);
+		buf[-1] = len;
+		return 27;
+	}
+	memcpy(buf, key + 1, len - 1);
+	buf[-1] = len - 1;
+	return (unsigned char)key[0];
+}
+
 int64_t FAST_FUNC read_key(int fd, char *buffer, int timeout) {
     struct pollfd pfd;
     const char *seq;
-    int n;
+    int n, wait;
 
     /* Known escape sequences for cursor and function keys.
 	 * See "Xterm Control Sequences"
@@ -378,11 +679,22 @@ int64_t FAST_FUNC read_key(int fd, char *buffer, int timeout) {
         'D' | 0x80,
         KEYCODE_ALT_LEFT,
         /* '[','3',';','3','~' |0x80,KEYCODE_ALT_DELETE, - unused */
+#if ENABLE_FEATURE_VI_PASTE
+        /* bracketed paste, the text follows: see read_paste() */
+        '[',
+        '2',
+        '0',
+        '0',
+        '~' | 0x80,
+        KEYCODE_PASTE,
+#endif
         0
     };
 
     pfd.fd = fd;
     pfd.events = POLLIN;
+    /* how long to wait for the rest of an ESC sequence */
+    wait = T_GET(kitty) == KITTY_ON ? -1 : esc_timeout;
 
     buffer++; /* saved chars counter is in buffer[-1] now */
 
@@ -394,20 +706,22 @@ start_over:
 		 * If requested, wait TIMEOUT ms. TIMEOUT = -1 is useful
 		 * if fd can be in non-blocking mode.
 		 */
-        if (timeout >= -1) {
-            if (safe_poll(&pfd, 1, timeout) == 0) {
+        if (timeout >= 0) {
+            if (key_poll(&pfd, timeout) == 0) {
                 /* Timed out */
                 errno = EAGAIN;
                 return -1;
             }
         }
-        /* It is tempting to read more than one byte here,
-		 * but it breaks pasting. Example: at shell prompt,
-		 * user presses "c","a","t" and then pastes "\nline\n".
-		 * When we were reading 3 bytes here, we were eating
-		 * "li" too, and cat was getting wrong input.
+        /* key_read() reads all there is, which is kept for the
+		 * next calls. Waiting for ever needs no poll first,
+		 * the read waits - unless fd is non-blocking.
 		 */
-        n = safe_read(fd, buffer, 1);
+        n = key_read(fd, buffer);
+        if (n < 0 && errno == EAGAIN && timeout == -1) {
+            key_poll(&pfd, -1);
+            n = key_read(fd, buffer);
+        }
         if (n <= 0)
             return -1;
     }
@@ -439,7 +753,7 @@ start_over:
 				 * so if we block for long it's not really an escape sequence.
 				 * Timeout is needed to reconnect escape sequences
 				 * split up by transmission over a serial console. */
-                if (safe_poll(&pfd, 1, 50) == 0) {
+                if (key_poll(&pfd, wait) == 0) {
                     /* No more data!
 					 * Array is sorted from shortest to longest,
 					 * we can't match anything later in array -
@@ -448,7 +762,7 @@ start_over:
                     goto got_all;
                 }
                 errno = 0;
-                if (safe_read(fd, buffer + n, 1) <= 0) {
+                if (key_read(fd, buffer + n) <= 0) {
                     /* If EAGAIN, then fd is O_NONBLOCK and poll lied:
 					 * in fact, there is no data. */
                     if (errno != EAGAIN) {
@@ -487,13 +801,41 @@ start_over:
 	 * We possibly read and stored more input in buffer[] by now.
 	 * n = bytes read. Try to read more until we time out.
 	 */
-    while (n < KEYCODE_BUFFER_SIZE - 1) { /* 1 for count byte at buffer[-1] */
-        if (safe_poll(&pfd, 1, 50) == 0) {
+#if ENABLE_FEATURE_VI_TERM_PROBE
+    if (n >= 1 && buffer[0] == 'P') {
+        /* DCS string, an answer to a probe */
+        read_dcs(&pfd);
+        buffer[-1] = 0;
+        goto start_over;
+    }
+#endif
+    while (1) {
+        /* CSI sequence is complete once its final byte is in
+         * ("ESC [ [ x" is a Linux console F-key, not CSI) */
+        if (n > 1 && buffer[0] == '[' && buffer[1] != '['
+         && (unsigned char)(buffer[n - 1] - 0x40) <= 0x3e
+        ) {
+            int c = csi_u(buffer, n);
+            if (c >= 0)
+                return c;
+#if ENABLE_FEATURE_VI_TERM_PROBE
+            csi_reply(buffer, n);
+#endif
+            break;
+        }
+        if (n >= KEYCODE_BUFFER_SIZE - 1) { /* 1 for count byte at buffer[-1] */
+            if (buffer[0] != '[')
+                break;
+            /* a long answer to a probe: eat it all,
+             * keeping only its last byte */
+            n--;
+        }
+        if (key_poll(&pfd, wait) == 0) {
             /* No more data! */
             break;
         }
         errno = 0;
-        if (safe_read(fd, buffer + n, 1) <= 0) {
+        if (key_read(fd, buffer + n) <= 0) {
             /* If EAGAIN, then fd is O_NONBLOCK and poll lied:
 			 * in fact, there is no data. */
             if (errno != EAGAIN) {
@@ -547,6 +889,7 @@ got_all:
     goto start_over;
 }
 
+#if !ENABLE_FEATURE_VI_READER_THREAD
 int64_t FAST_FUNC safe_read_key(int fd, char *buffer, int timeout)
 {
 	int64_t r;
@@ -554,8 +897,123 @@ int64_t FAST_FUNC safe_read_key(int fd, char *buffer, int timeout)
 		/* errno = 0; - read_key does this itself */
 		r = read_key(fd, buffer, timeout);
 	} while (errno == EINTR);
+	IF_FEATURE_VI_STATS(T.keys += (r != -1);)
 	return r;
 }
+#endif
+
+#if ENABLE_FEATURE_VI_PASTE
+// bytes a paste without brackets is made of
+static int is_text(unsigned char c)
+{
+	return (c >= ' ' && c != 0x7f) || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Read pasted text up to the closing "ESC [ 2 0 1 ~", after read_key()
+// returned KEYCODE_PASTE. Anything typed after it is kept in buffer[].
+// Returns a malloced string, its length in *lenp.
+static char *paste_text(int fd, char *buffer, int *lenp)
+{
+	static const char end_mark[] ALIGN1 = ESC"[201~";
+	struct pollfd pfd;
+	char *s = NULL, *e = NULL;
+	int len = 0, size = 0;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (1) {
+		int n, from;
+
+		if (size - len < 4096) {
+			size = size * 2 + 4096;
+			s = xrealloc(s, size + 1);
+		}
+		// a terminal which lost the end mark mustn't hang us
+		if (key_poll(&pfd, 1000) <= 0)
+			break;
+		if (ahead_pos < ahead_len) {
+			n = MIN(ahead_len - ahead_pos, size - len);
+			memcpy(s + len, ahead + ahead_pos, n);
+			ahead_pos += n;
+		} else {
+			COUNT_SYSCALL();
+			n = safe_read(fd, s + len, size - len);
+			if (n <= 0)
+				break;
+		}
+		// the end mark can be split between reads
+		from = MAX(len - (int)sizeof(end_mark) + 2, 0);
+		len += n;
+		e = memmem(s + from, len - from, end_mark, sizeof(end_mark) - 1);
+		if (e)
+			break;
+	}
+	if (e) {
+		int n = s + len - (e + sizeof(end_mark) - 1);
+
+		n = MIN(n, KEYCODE_BUFFER_SIZE - 1);
+		memcpy(buffer + 1, e + sizeof(end_mark) - 1, n);
+		buffer[0] = n;
+		len = e - s;
+	}
+	s[len] = '\0';
+	*lenp = len;
+	return s;
+}
+
+# if !ENABLE_FEATURE_VI_READER_THREAD
+char* FAST_FUNC read_paste(int fd, char *buffer, int *lenp)
+{
+	return paste_text(fd, buffer, lenp);
+}
+
+// Text which is already waiting after the key just read, from a
+// paste into a terminal without bracketed paste: if there are at least
+// *lenp bytes of it, return them and their count in *lenp, so that
+// they can be inserted as one. Stops before anything which isn't text.
+// What isn't returned is left for read_key().
+char* FAST_FUNC read_burst(int fd, char *buffer, int *lenp)
+{
+	struct pollfd pfd;
+	char *s;
+	int len, n, i;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	len = (unsigned char)buffer[0];
+	n = ahead_len - ahead_pos;
+	if (len + n == 0 && safe_poll(&pfd, 1, 0) <= 0)
+		return NULL;
+	// the key buffer, then what's left ahead, then the terminal
+	s = xmalloc(len + n + 4096 + 1);
+	memcpy(s, buffer + 1, len);
+	memcpy(s + len, ahead + ahead_pos, n);
+	len += n;
+	buffer[0] = 0;
+	while (safe_poll(&pfd, 1, 0) > 0) {
+		s = xrealloc(s, len + 4096 + 1);
+		COUNT_SYSCALL();
+		n = safe_read(fd, s + len, 4096);
+		if (n <= 0)
+			break;
+		len += n;
+	}
+	free(ahead);
+	ahead = s;
+	ahead_len = len;
+	ahead_size = 0;		// key_read() won't refill it
+	for (i = 0; i < len && is_text(s[i]); i++)
+		continue;
+	if (i < *lenp) {
+		ahead_pos = 0;
+		return NULL;
+	}
+	ahead_pos = i;
+	*lenp = i;
+	return s;
+}
+# endif
+#endif
 
 void FAST_FUNC show_help(void)
 {
@@ -595,6 +1053,431 @@ void FAST_FUNC write1(const char *out)
 	fputs_stdout(out);
 }
 
+// What was sent to the terminal since output_backlog() last asked how
+// much of its output is still queued, plus what was queued then:
+// more than could be queued now.
+static size_t owed;
+
+#if ENABLE_FEATURE_VI_WRITER_THREAD
+// Whatever stdout flushes is added to a frame, which the writer
+// thread takes from a single slot and sends to the terminal. A frame
+// the writer hasn't taken yet is taken back and added to, so there is
+// never more than one waiting. While the writer is busy the editor
+// doesn't redraw (see output_backlog()), and once it is done the
+// next redraw sends the newest screen: the states in between are
+// never drawn at all.
+struct frame {
+	size_t len, size;
+	char buf[];
+};
+static struct frame *mailbox;	// exchanged atomically
+static int writing;		// writer is sending a frame
+static sem_t frame_ready;
+
+static void *writer(void *arg UNUSED_PARAM)
+{
+	for (;;) {
+		struct frame *f;
+
+		sem_wait(&frame_ready);
+		__atomic_store_n(&writing, 1, __ATOMIC_SEQ_CST);
+		f = __atomic_exchange_n(&mailbox, NULL, __ATOMIC_ACQ_REL);
+		if (f) {
+			COUNT_SYSCALL();
+			full_write(STDOUT_FILENO, f->buf, f->len);
+			free(f);
+		}
+		__atomic_store_n(&writing, 0, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static ssize_t frame_write(void *cookie UNUSED_PARAM, const char *buf, size_t n)
+{
+	struct frame *f = __atomic_exchange_n(&mailbox, NULL, __ATOMIC_ACQ_REL);
+	size_t len = f ? f->len : 0;
+
+	if (!f || len + n > f->size) {
+		size_t size = MAX(len + n, 2 * len) + 1024;
+
+		f = xrealloc(f, sizeof(*f) + size);
+		f->size = size;
+	}
+	memcpy(f->buf + len, buf, n);
+	f->len = len + n;
+	owed += n;
+	__atomic_store_n(&mailbox, f, __ATOMIC_RELEASE);
+	sem_post(&frame_ready);
+	return n;
+}
+
+static int writer_busy(void)
+{
+	return __atomic_load_n(&mailbox, __ATOMIC_ACQUIRE)
+		|| __atomic_load_n(&writing, __ATOMIC_ACQUIRE);
+}
+
+// wait until everything written so far is on its way to the terminal
+static void writer_drain(void)
+{
+	fflush(stdout);
+	while (writer_busy())
+		usleep(10 * 1000);
+}
+
+// point stdout at the writer thread
+static void start_writer(void)
+{
+	static const cookie_io_functions_t io = { .write = frame_write };
+	static smallint started;
+	sigset_t all, old;
+	pthread_t tid;
+	FILE *fp;
+	int err;
+
+	if (started)
+		return;
+	started = 1;
+	fp = fopencookie(NULL, "w", io);
+	if (!fp)
+		return;
+	sem_init(&frame_ready, 0, 0);
+	// signal handlers must run in the editor's thread, not the writer
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&tid, NULL, writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		fclose(fp);
+		return;
+	}
+	pthread_detach(tid);
+	fflush(stdout);
+	stdout = fp;
+	atexit(writer_drain);
+}
+#else
+// stdout, fully buffered: each flush is a single write
+static ssize_t term_write(void *cookie UNUSED_PARAM, const char *buf, size_t n)
+{
+	owed += n;
+	COUNT_SYSCALL();
+	return full_write(STDOUT_FILENO, buf, n);
+}
+
+static void start_writer(void)
+{
+	static const cookie_io_functions_t io = { .write = term_write };
+	static smallint started;
+	FILE *fp;
+
+	if (started)
+		return;
+	started = 1;
+	fp = fopencookie(NULL, "w", io);
+	if (fp) {
+		fflush(stdout);
+		stdout = fp;
+	}
+}
+#endif
+
+#if ENABLE_FEATURE_VI_READER_THREAD
+// Keys are read and decoded as they come in by a thread of their own,
+// into a ring which only the reader adds to and only the editor takes
+// from, so it needs no lock. The editor sees how much typeahead there
+// is without a system call, and ^C is seen by long commands which
+// look at interrupted(), instead of jumping out of them.
+// A byte in key_pipe wakes the editor up when it waits for a key,
+// one in ctl_pipe asks the reader to let go of the terminal.
+enum { KEY_RING = 1024 };	// a power of two
+static struct key {
+	int64_t code;
+	char *text;		// KEYCODE_PASTE: what was pasted
+	int len;
+} key_ring[KEY_RING];
+static unsigned key_head, key_tail;	// added at head, taken at tail
+static int key_pipe[2], ctl_pipe[2];
+static sem_t reader_ack, reader_go;
+static int reader_pause;	// cookmode() wants the terminal
+static int key_waiting;		// the editor is (about to be) in wait_key()
+static smallint reader_on, reader_paused;
+static volatile sig_atomic_t intr;
+static smallint intr_key;	// the key taken last is the ESC of a ^C
+static char *key_text;		// of the KEYCODE_PASTE taken last
+static int key_text_len;
+
+// Ordered with wait_key(): either the editor sees the new key,
+// or the reader sees it is waiting and wakes it up.
+static unsigned typeahead(void)
+{
+	return __atomic_load_n(&key_head, __ATOMIC_SEQ_CST) - key_tail;
+}
+
+static void take_keys(unsigned n)
+{
+	__atomic_store_n(&key_tail, key_tail + n, __ATOMIC_SEQ_CST);
+}
+
+// stop until rawmode(), if cookmode() asked for it
+static void reader_check_pause(void)
+{
+	char c;
+
+	while (read(ctl_pipe[0], &c, 1) > 0)
+		continue;
+	if (__atomic_load_n(&reader_pause, __ATOMIC_ACQUIRE)) {
+		sem_post(&reader_ack);
+		while (sem_wait(&reader_go) != 0)
+			continue;
+	}
+}
+
+// a byte in key_pipe, only if the editor waits for one
+static void wake_editor(void)
+{
+	if (__atomic_exchange_n(&key_waiting, 0, __ATOMIC_SEQ_CST)) {
+		COUNT_SYSCALL();
+		if (write(key_pipe[1], "", 1) < 0)
+			errno = 0;	// full: it has been woken up already
+	}
+}
+
+static void reader_push(int64_t code, char *text, int len)
+{
+	struct key *k = &key_ring[key_head % KEY_RING];
+
+	// a full ring waits for the editor to catch up
+	while (key_head - __atomic_load_n(&key_tail, __ATOMIC_ACQUIRE) >= KEY_RING) {
+		reader_check_pause();
+		usleep(1000);
+	}
+	k->code = code;
+	k->text = text;
+	k->len = len;
+	__atomic_store_n(&key_head, key_head + 1, __ATOMIC_SEQ_CST);
+	wake_editor();
+}
+
+static void *reader(void *arg UNUSED_PARAM)
+{
+	// read_key() state of its own: bytes read ahead, count in [0]
+	static char buf[KEYCODE_BUFFER_SIZE];
+	struct pollfd pfd[2];
+	int nfds = 2;
+
+	pfd[0].fd = ctl_pipe[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = STDIN_FILENO;
+	pfd[1].events = POLLIN;
+	for (;;) {
+		int64_t code;
+		char *text = NULL;
+		int len = 0;
+
+		if (!buf[0] && ahead_pos == ahead_len) {
+			// wait for the terminal, or to be asked to let go of it
+			COUNT_SYSCALL();
+			if (poll(pfd, nfds, -1) <= 0)
+				continue;
+			if (pfd[0].revents) {
+				reader_check_pause();
+				continue;
+			}
+		}
+		// there is input: no need to poll for it first
+		code = read_key(STDIN_FILENO, buf, -2);
+		if (code == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			nfds = 1;	// EOF: from now on, only wait for cookmode()
+		}
+# if ENABLE_FEATURE_VI_PASTE
+		if (code == KEYCODE_PASTE)
+			text = paste_text(STDIN_FILENO, buf, &len);
+# endif
+		reader_push(code, text, len);
+	}
+	return NULL;
+}
+
+static void start_reader(void)
+{
+	sigset_t all, old;
+	pthread_t tid;
+	int err;
+
+	if (reader_on)
+		return;
+	reader_on = 1;
+	if (pipe2(key_pipe, O_NONBLOCK | O_CLOEXEC) != 0
+	 || pipe2(ctl_pipe, O_NONBLOCK | O_CLOEXEC) != 0
+	) {
+		bb_simple_error_msg_and_die("can't create pipe");
+	}
+	// the editor waits for a key in a read of it
+	fcntl(key_pipe[0], F_SETFL, 0);
+	sem_init(&reader_ack, 0, 0);
+	sem_init(&reader_go, 0, 0);
+	// signal handlers must run in the editor's thread, not the reader
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&tid, NULL, reader, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err)
+		bb_simple_error_msg_and_die("can't create thread");
+	pthread_detach(tid);
+}
+
+// Wait up to timeout ms, -1: for ever, for a key or an interrupt.
+// The ring says if there is one, so a zero timeout costs nothing,
+// and waiting for ever is a single read of key_pipe.
+static int wait_key(int timeout)
+{
+	struct pollfd pfd;
+	char buf[64];
+
+	pfd.fd = key_pipe[0];
+	pfd.events = POLLIN;
+	for (;;) {
+		int n;
+
+		if (typeahead() || intr)
+			return 1;
+		if (timeout == 0)
+			return 0;
+		__atomic_store_n(&key_waiting, 1, __ATOMIC_SEQ_CST);
+		if (typeahead() || intr) {
+			__atomic_store_n(&key_waiting, 0, __ATOMIC_SEQ_CST);
+			return 1;
+		}
+		if (timeout > 0) {
+			COUNT_SYSCALL();
+			n = poll(&pfd, 1, timeout);
+			if (n == 0) {
+				__atomic_store_n(&key_waiting, 0, __ATOMIC_SEQ_CST);
+				return 0;
+			}
+			if (n < 0)
+				continue;	// a signal, maybe ^C
+		}
+		// key_pipe blocks reads, the reader and the SIGINT
+		// handler never block writing it
+		COUNT_SYSCALL();
+		if (read(key_pipe[0], buf, sizeof(buf)) < 0)
+			errno = 0;	// EINTR
+	}
+}
+
+int64_t FAST_FUNC safe_read_key(int fd, char *buffer, int timeout)
+{
+	struct key *k;
+
+	intr_key = 0;
+	// CRASHME puts its commands here
+	if (buffer[0])
+		return read_key(fd, buffer, timeout);
+
+	if (!wait_key(timeout)) {
+		errno = EAGAIN;
+		return -1;
+	}
+	errno = 0;
+	if (intr) {
+		// ^C: typeahead is dropped, and it acts like ESC
+		intr = 0;
+		intr_key = 1;
+		while (typeahead()) {
+			free(key_ring[key_tail % KEY_RING].text);
+			take_keys(1);
+		}
+		return 27;
+	}
+	k = &key_ring[key_tail % KEY_RING];
+	key_text = k->text;
+	key_text_len = k->len;
+	take_keys(1);
+	IF_FEATURE_VI_STATS(T.keys++;)
+	return k->code;
+}
+
+# if ENABLE_FEATURE_VI_PASTE
+// the text of the KEYCODE_PASTE just taken, which the reader has read
+char* FAST_FUNC read_paste(int fd UNUSED_PARAM, char *buffer UNUSED_PARAM, int *lenp)
+{
+	char *s = key_text ?: xzalloc(1);
+
+	*lenp = key_text ? key_text_len : 0;
+	key_text = NULL;
+	return s;
+}
+
+// the plain bytes at the head of the ring, if there are at least *lenp
+char* FAST_FUNC read_burst(int fd UNUSED_PARAM, char *buffer UNUSED_PARAM, int *lenp)
+{
+	static char *burst;
+	unsigned i, n = typeahead();
+
+	for (i = 0; i < n; i++) {
+		int64_t c = key_ring[(key_tail + i) % KEY_RING].code;
+		if (c < 0 || c > 0xff || !is_text(c))
+			break;
+	}
+	if ((int)i < *lenp)
+		return NULL;
+	free(burst);
+	burst = xmalloc(i + 1);
+	for (n = 0; n < i; n++)
+		burst[n] = key_ring[(key_tail + n) % KEY_RING].code;
+	take_keys(i);
+	*lenp = i;
+	return burst;
+}
+# endif
+
+// From the SIGINT handler: long commands stop when they see it,
+// and the next key read is an ESC.
+void FAST_FUNC interrupt_keys(void)
+{
+	intr = 1;
+	// the editor may be waiting in a read which SA_RESTART restarts
+	__atomic_store_n(&key_waiting, 1, __ATOMIC_SEQ_CST);
+	wake_editor();
+}
+
+int FAST_FUNC interrupted(void)
+{
+	return intr;
+}
+
+// Is the ESC just read a ^C? Which, unlike ESC, throws a line away
+int FAST_FUNC interrupt_key(void)
+{
+	return intr_key;
+}
+
+static void reader_stop(void)
+{
+	if (!reader_on || reader_paused)
+		return;
+	__atomic_store_n(&reader_pause, 1, __ATOMIC_RELEASE);
+	if (write(ctl_pipe[1], "", 1) < 0)
+		errno = 0;
+	while (sem_wait(&reader_ack) != 0)
+		continue;
+	reader_paused = 1;
+}
+
+static void reader_start(void)
+{
+	if (!reader_paused)
+		return;
+	__atomic_store_n(&reader_pause, 0, __ATOMIC_RELEASE);
+	reader_paused = 0;
+	sem_post(&reader_go);
+}
+#endif
+
 #if ENABLE_FEATURE_VI_WIN_RESIZE
 int FAST_FUNC query_screen_dimensions(void)
 {
@@ -615,14 +1498,115 @@ int FAST_FUNCT query_screen_dimensions(void)
 // sleep for 'h' 1/100 seconds, return 1/0 if stdin is (ready for read)/(not ready)
 int FAST_FUNC mysleep(int hund)
 {
+#if ENABLE_FEATURE_VI_READER_THREAD
+	if (hund != 0)
+		fflush_all();
+	return wait_key(hund*10);
+#else
 	struct pollfd pfd[1];
 
 	if (hund != 0)
 		fflush_all();
+	else if (ahead_pos == ahead_len && drained_ms
+	 && (unsigned)monotonic_ms() - drained_ms < 10
+	) {
+		// the terminal had nothing more a moment ago: a key
+		// typed since can't be missed for long, it only costs
+		// the frame drawn before it is read
+		return 0;
+	}
 
 	pfd[0].fd = STDIN_FILENO;
 	pfd[0].events = POLLIN;
-	return safe_poll(pfd, 1, hund*10) > 0;
+	return key_poll(pfd, hund*10) > 0;
+#endif
+}
+
+// baud rate of the terminal, 0 if unknown
+int FAST_FUNC tty_baud(void)
+{
+	static const struct {
+		speed_t code;
+		int baud;
+	} speeds[] = {
+		{ B300, 300 }, { B1200, 1200 }, { B2400, 2400 },
+		{ B4800, 4800 }, { B9600, 9600 }, { B19200, 19200 },
+		{ B38400, 38400 },
+#ifdef B57600
+		{ B57600, 57600 },
+#endif
+#ifdef B115200
+		{ B115200, 115200 },
+#endif
+#ifdef B230400
+		{ B230400, 230400 },
+#endif
+	};
+	struct termios t;
+	speed_t sp;
+	int i;
+
+	if (tcgetattr(STDOUT_FILENO, &t) != 0)
+		return 0;
+	sp = cfgetospeed(&t);
+	for (i = 0; i < ARRAY_SIZE(speeds); i++)
+		if (speeds[i].code == sp)
+			return speeds[i].baud;
+	return 0;
+}
+
+// return 1 if more output is queued for the terminal than it can
+// send in about 50ms, 0 if it keeps up (or we can't tell)
+int FAST_FUNC output_backlog(void)
+{
+#ifdef TIOCOUTQ
+	static int high_water;
+	int queued;
+#endif
+
+#if ENABLE_FEATURE_VI_WRITER_THREAD
+	// still sending an earlier frame? (not counting what we flush now)
+	if (writer_busy())
+		return 1;
+#endif
+	fflush_all();
+#ifdef TIOCOUTQ
+	if (!high_water) {
+		// 10 bits per char on the line, minimum of a few rows
+		high_water = tty_baud() / 10 / 20;
+		if (high_water < 512)
+			high_water = 512;
+	}
+	// not worth asking if all that was sent would fit
+	if (owed <= (size_t)high_water)
+		return 0;
+	COUNT_SYSCALL();
+	owed = 0;
+	if (ioctl(STDOUT_FILENO, TIOCOUTQ, &queued) == 0)
+		owed = queued;
+	return owed > (size_t)high_water;
+#else
+	return 0;
+#endif
+}
+
+// is it a real serial line, slow enough to be worth saving bytes?
+int FAST_FUNC slow_tty(void)
+{
+	int baud = tty_baud();
+	const char *name;
+
+	if (baud == 0 || baud > 115200)
+		return 0;
+	// ptys report a made up speed
+	name = ttyname(STDOUT_FILENO);
+	if (!name || strncmp(name, "/dev/pts/", 9) == 0
+	 || strncmp(name, "/dev/ttyp", 9) == 0
+	 || strncmp(name, "/dev/ttys", 9) == 0
+	) {
+		return 0;
+	}
+	return 1;
 }
 
 //----- Set terminal attributes --------------------------------
@@ -630,11 +1614,30 @@ void FAST_FUNC rawmode(void)
 {
 	// no TERMIOS_CLEAR_ISIG: leave ISIG on - allow signals
 	set_termios_to_raw(STDIN_FILENO, &term_orig, TERMIOS_RAW_CRNL);
+#if ENABLE_FEATURE_VI_PASTE
+	write1(ESC"[?2004h");	// pastes come in brackets
+#endif
+	T.raw = 1;
+	kitty_mode(T.want_kitty);
+#if ENABLE_FEATURE_VI_READER_THREAD
+	reader_start();
+#endif
 }
 
 void FAST_FUNC cookmode(void)
 {
+	kitty_mode(0);
+	T.raw = 0;
+#if ENABLE_FEATURE_VI_PASTE
+	write1(ESC"[?2004l");
+#endif
 	fflush_all();
+#if ENABLE_FEATURE_VI_WRITER_THREAD
+	writer_drain();
+#endif
+#if ENABLE_FEATURE_VI_READER_THREAD
+	reader_stop();	// the terminal is someone else's now
+#endif
 	tcsetattr_stdin_TCSANOW(&term_orig);
 }
 
@@ -669,6 +1672,41 @@ void FAST_FUNC clear_to_eol(void)
 	write1(ESC_CLEAR2EOL);
 }
 
+//----- Write chars at the cursor using as few bytes as we can ---
+// Runs of one char are sent as REP, trailing blanks are erased
+// ('to_eol': the rest of the line is blank, so up to its end).
+void FAST_FUNC write_span(const char *s, int len, int to_eol)
+{
+	char buf[sizeof(ESC_REPEAT_CHAR) + sizeof(int)*3];
+	int i, n, blanks;
+
+	for (blanks = 0; blanks < len && s[len - 1 - blanks] == ' ';)
+		blanks++;
+	len -= blanks;
+	for (i = 0; i < len; i += n) {
+		for (n = 1; i + n < len && s[i + n] == s[i]; n++)
+			continue;
+		// "ESC [ n b" pays off past 5 or so repeats
+		if (T_GET(has_rep) && n > 6) {
+			bb_putchar(s[i]);
+			sprintf(buf, ESC_REPEAT_CHAR, n - 1);
+			write1(buf);
+		} else {
+			fwrite(s + i, n, 1, stdout);
+		}
+	}
+	if (blanks > 3) {
+		if (to_eol) {
+			clear_to_eol();
+		} else {
+			sprintf(buf, ESC_ERASE_CHARS, blanks);
+			write1(buf);
+		}
+	} else {
+		fwrite(s + len, blanks, 1, stdout);
+	}
+}
+
 //----- Go to upper left corner and erase screen ---------------
 void FAST_FUNC home_and_clear_to_eos(void)
 {
@@ -681,16 +1719,39 @@ void FAST_FUNC go_bottom_and_clear_to_eol(void)
 	clear_to_eol();
 }
 
+//----- Draw the following chars with attribute 'attr' ---------
+void FAST_FUNC set_attr(int attr)
+{
+	// SGR parameters of ATTR_xxx
+	static const char *const sgr[] = {
+		"",
+		"7",		// reverse
+		"30;43",	// black on yellow
+		"36",		// cyan
+		"35",		// magenta
+		"33",		// yellow
+		"34",		// blue
+	};
+
+	if (attr == T.attr)
+		return;
+	if (attr == ATTR_NORMAL)
+		write1(ESC_NORM_TEXT);
+	else	// reset first when switching from another attribute
+		printf(T.attr ? ESC"[0;%sm" : ESC"[%sm", sgr[attr]);
+	T.attr = attr;
+}
+
 //----- Start standout mode ------------------------------------
 void FAST_FUNC standout_start(void)
 {
-	write1(ESC_BOLD_TEXT);
+	set_attr(ATTR_STANDOUT);
 }
 
 //----- End standout mode --------------------------------------
 void FAST_FUNC standout_end(void)
 {
-	write1(ESC_NORM_TEXT);
+	set_attr(ATTR_NORMAL);
 }
 
 //----- Ring a bell --------------------------------------------
@@ -699,32 +1760,56 @@ void FAST_FUNC bell(void)
 	write1(ESC_BELL);
 }
 
+// Hold back (on != 0) or show screen updates, if the terminal
+// has synchronized output
+void FAST_FUNC sync_output(int on)
+{
+	if (T_GET(has_sync))
+		write1(on ? ESC"[?2026h" : ESC"[?2026l");
+}
+
 //----- Initialize terminal ------------------------------------
 void FAST_FUNC init_term(void)
 {
+	const char *term = getenv("TERM");
+
+	start_writer();
+#if ENABLE_FEATURE_VI_READER_THREAD
+	start_reader();
+#endif
 	rawmode();
+#if ENABLE_FEATURE_VI_TERM_PROBE
+	probe_terminal(term);
+#else
+	// REP is ECMA-48, but VTxxx and the Linux console don't have it
+	T_SET(has_rep, term && strncmp(term, "xterm", 5) == 0);
+#endif
 	rows = 24;
 	columns = 80;
 	IF_FEATURE_VI_ASK_TERMINAL(T.get_rowcol_error =) query_screen_dimensions();
 #if ENABLE_FEATURE_VI_ASK_TERMINAL
 	if (T.get_rowcol_error /* TODO? && no input on stdin */) {
-		uint64_t k;
+		// the answer comes in with the keys, see cursor_report()
 		write1(ESC"[999;999H" ESC"[6n");
-		fflush_all();
-		k = safe_read_key(STDIN_FILENO, readbuffer, /*timeout_ms:*/ 100);
-		if ((int32_t)k == KEYCODE_CURSOR_POS) {
-			uint32_t rc = (k >> 32);
-			columns = (rc & 0x7fff);
-			if (columns > MAX_SCR_COLS)
-				columns = MAX_SCR_COLS;
-			rows = ((rc >> 16) & 0x7fff);
-			if (rows > MAX_SCR_ROWS)
-				rows = MAX_SCR_ROWS;
-		}
 	}
 #endif
 }
 
+#if ENABLE_FEATURE_VI_ASK_TERMINAL
+// the window size from a KEYCODE_CURSOR_POS answer to init_term()
+void FAST_FUNC cursor_report(int64_t k)
+{
+	uint32_t rc = (k >> 32);
+
+	columns = (rc & 0x7fff);
+	if (columns > MAX_SCR_COLS)
+		columns = MAX_SCR_COLS;
+	rows = ((rc >> 16) & 0x7fff);
+	if (rows > MAX_SCR_ROWS)
+		rows = MAX_SCR_ROWS;
+}
+#endif
+
 void FAST_FUNC alternate_screen_buffer_start(void)
 {
 	// "Save cursor, use alternate screen buffer, clear screen"
@@ -736,3 +1821,16 @@ void FAST_FUNC alternate_screen_buffer_end(void)
 	// "Use normal screen buffer, restore cursor"
 	write1(ESC"[?1049l");
 }
+
+void FAST_FUNC reverse_video_start(void)
+{
+	// "Reverse video" screen mode (DECSCNM), the terminal
+	// repaints by itself
+	write1(ESC"[?5h");
+}
+
+void FAST_FUNC reverse_video_end(void)
+{
+	// "Normal video"
+	write1(ESC"[?5l");
+}
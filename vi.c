@@ -10,7 +10,6 @@
 //	./.exrc
 //	add magic to search	/foo.*bar
 //	add :help command
-//	:map macros
 //	if mark[] values were line numbers rather than pointers
 //	it would be easier to change the mark when add/delete lines
 //	More intelligence in refresh()
@@ -45,6 +44,14 @@
 //config:	If your terminal combines several 8-bit bytes into one character
 //config:	(as in Unicode mode), this will not work properly.
 //config:
+//config:config FEATURE_VI_UTF8
+//config:	bool "Display and edit UTF-8 text"
+//config:	default y
+//config:	depends on VI
+//config:	help
+//config:	In a UTF-8 locale, show multibyte chars in as many columns
+//config:	as they take, and move the cursor over whole chars.
+//config:
 //config:config FEATURE_VI_COLON
 //config:	bool "Enable \":\" colon commands (no \"ex\" mode)"
 //config:	default y
@@ -77,10 +84,20 @@
 //config:
 //config:config FEATURE_VI_REGEX_SEARCH
 //config:	bool "Enable regex in search and replace"
-//config:	default n   # Uses GNU regex, which may be unavailable. FIXME
+//config:	default y
 //config:	depends on FEATURE_VI_SEARCH
 //config:	help
-//config:	Use extended regex search.
+//config:	Use POSIX basic regular expressions, with \+ \? \| \< \>
+//config:	but no back references, in / ? searches and :s.
+//config:
+//config:config FEATURE_VI_SEARCH_THREADS
+//config:	bool "Search large files on several threads"
+//config:	default y
+//config:	depends on FEATURE_VI_SEARCH
+//config:	help
+//config:	A search over many megabytes is cut in pieces, which a thread
+//config:	per CPU take in turn, nearest first. Pieces past one with a
+//config:	match are not looked at.
 //config:
 //config:config FEATURE_VI_USE_SIGNALS
 //config:	bool "Catch signals"
@@ -97,6 +114,22 @@
 //config:	help
 //config:	Make vi remember the last command and be able to repeat it.
 //config:
+//config:config FEATURE_VI_MAP
+//config:	bool "Support :map and :map! key mappings"
+//config:	default y
+//config:	depends on FEATURE_VI_COLON && FEATURE_VI_DOT_CMD
+//config:	help
+//config:	Map keys to others in command mode (:map, :noremap) and in
+//config:	insert mode and on the command line (:map!, :noremap!).
+//config:
+//config:config FEATURE_VI_MACRO
+//config:	bool "Support q and @ macros"
+//config:	default y
+//config:	depends on FEATURE_VI_YANKMARK && FEATURE_VI_DOT_CMD
+//config:	help
+//config:	Record the keys typed into a register with q, and replay
+//config:	them with @. The screen is redrawn once the replay is done.
+//config:
 //config:config FEATURE_VI_READONLY
 //config:	bool "Enable -R option and \"view\" mode"
 //config:	default y
@@ -110,13 +143,21 @@
 //config:	default y
 //config:	depends on VI
 //config:	help
-//config:	Enable the editor to set some (ai, ic, showmatch) options.
+//config:	Enable the editor to set some (ai, hls, ic, nu, showmatch) options.
 //config:
 //config:config FEATURE_VI_SET
 //config:	bool "Support :set"
 //config:	default y
 //config:	depends on VI
 //config:
+//config:config FEATURE_VI_SYNTAX
+//config:	bool "Enable syntax highlighting"
+//config:	default y
+//config:	depends on FEATURE_VI_SETOPTS
+//config:	help
+//config:	Color comments, strings, keywords and preprocessor lines
+//config:	of C, shell and config files, after :set syntax.
+//config:
 //config:config FEATURE_VI_WIN_RESIZE
 //config:	bool "Handle window resize"
 //config:	default y
@@ -135,6 +176,53 @@
 //config:	cursor position using "ESC [ 6 n" escape sequence, then read stdin.
 //config:	This is not clean but helps a lot on serial lines and such.
 //config:
+//config:config FEATURE_VI_TERM_PROBE
+//config:	bool "Ask the terminal what it can do"
+//config:	default y
+//config:	depends on VI
+//config:	help
+//config:	Query the terminal's version and whether it has synchronized
+//config:	output, without waiting for the answers. What it says is
+//config:	remembered in ~/.cache/vi_term for the next start.
+//config:
+//config:config FEATURE_VI_WRITER_THREAD
+//config:	bool "Write to the terminal from a separate thread"
+//config:	default y
+//config:	depends on VI
+//config:	help
+//config:	Screen updates are handed to a thread which does the writing,
+//config:	so that a slow or stalled terminal doesn't hold up commands.
+//config:	The screen is redrawn once the thread has caught up.
+//config:
+//config:config FEATURE_VI_READER_THREAD
+//config:	bool "Read keys in a separate thread"
+//config:	default y
+//config:	depends on VI
+//config:	help
+//config:	Keys are read and decoded by a thread as they are typed, also
+//config:	while a command runs. ^C stops long commands, and then acts
+//config:	like ESC: :s, a search, a repeated '.' or @, a command with
+//config:	a count, and reading or writing a file. A write it stops
+//config:	leaves the file cut short.
+//config:
+//config:config FEATURE_VI_PASTE
+//config:	bool "Insert pasted text in one go"
+//config:	default y
+//config:	depends on VI
+//config:	help
+//config:	Turn on the terminal's bracketed paste, and insert what is pasted
+//config:	at once, as one change for undo and without autoindent.
+//config:	Without bracketed paste, a burst of text arriving in insert
+//config:	mode is taken to be a paste.
+//config:
+//config:config FEATURE_VI_STATS
+//config:	bool "Count system calls per key (:stats)"
+//config:	default y
+//config:	depends on FEATURE_VI_COLON
+//config:	help
+//config:	Count the keys read from the terminal and the system calls made
+//config:	to read and draw them, which :stats shows.
+//config:
 //config:config FEATURE_VI_UNDO
 //config:	bool "Support undo command \"u\""
 //config:	default y
@@ -195,10 +283,6 @@
 
 #include "libbb.h"
 #include "terminal.h"
-// Should be after libbb.h: on some systems regex.h needs sys/types.h:
-#if ENABLE_FEATURE_VI_REGEX_SEARCH
-# include <regex.h>
-#endif
 
 // the CRASHME code is unmaintained, and doesn't currently build
 #define ENABLE_FEATURE_VI_CRASHME 0
@@ -249,6 +333,8 @@ enum {
 	S_END_ALNUM = 5,	// used in skip_thing() for moving "dot"
 
 	C_END = -1,	// cursor is at end of line due to '$' command
+
+	PASTE_BURST = 32,	// bytes of text waiting which make a paste
 };
 
 
@@ -256,6 +342,23 @@ enum {
 // busybox build system provides that, but it's better
 // to audit and fix the source
 
+// cells drawn from text offset 'pos' of a line on have attribute 'attr'
+struct attr_span {
+	int pos;
+	int attr;
+};
+
+#if ENABLE_FEATURE_VI_MAP
+// A key of a :map lhs. The nodes are in one array, linked by index.
+struct map_node {
+	int child, next;	// first child, next sibling: 0 if none
+	int count;		// lhs ending here or below
+	char *rhs;		// what the lhs ending here maps to
+	unsigned char key;
+	smallint nore;		// :noremap - rhs isn't mapped again
+};
+#endif
+
 struct globals {
 	// many references - keep near the top of globals
 	char *text, *end;       // pointers to the user data in memory
@@ -264,31 +367,61 @@ struct globals {
 
 	// the rest
 #if ENABLE_FEATURE_VI_SETOPTS
-	smallint vi_setops;     // set by setops()
+	int vi_setops;          // set by setops()
 #define VI_AUTOINDENT (1 << 0)
-#define VI_EXPANDTAB  (1 << 1)
-#define VI_ERR_METHOD (1 << 2)
-#define VI_IGNORECASE (1 << 3)
-#define VI_SHOWMATCH  (1 << 4)
-#define VI_TABSTOP    (1 << 5)
+#define VI_ESCTIMEOUT (1 << 1)
+#define VI_EXPANDTAB  (1 << 2)
+#define VI_ERR_METHOD (1 << 3)
+#define VI_HLSEARCH   (1 << 4)
+#define VI_IGNORECASE (1 << 5)
+#define VI_INCSEARCH  (1 << 6)
+#define VI_KITTYKEYS  (1 << 7)
+#define VI_NUMBER     (1 << 8)
+#define VI_RELNUMBER  (1 << 9)
+#define VI_SLOWOPEN   (1 << 10)
+#define VI_SHOWMATCH  (1 << 11)
+#define VI_SYNTAX     (1 << 12)
+#define VI_TABSTOP    (1 << 13)
+#define VI_TIMEOUTLEN (1 << 14)
 #define autoindent (vi_setops & VI_AUTOINDENT)
 #define expandtab  (vi_setops & VI_EXPANDTAB )
 #define err_method (vi_setops & VI_ERR_METHOD) // indicate error with beep or flash
+#define hlsearch   (vi_setops & VI_HLSEARCH  ) // highlight matches of last search
 #define ignorecase (vi_setops & VI_IGNORECASE)
+#define incsearch  (vi_setops & VI_INCSEARCH ) // go to matches while typing
+#define kittykeys  (vi_setops & VI_KITTYKEYS ) // kitty keyboard protocol
+#define shownumber (vi_setops & VI_NUMBER    )
+#define relativenumber (vi_setops & VI_RELNUMBER)
+#define slowopen   (vi_setops & VI_SLOWOPEN  ) // spend few bytes on output
 #define showmatch  (vi_setops & VI_SHOWMATCH )
+#define syntax     (vi_setops & VI_SYNTAX    ) // highlight syntax
 // order of constants and strings must match
 #define OPTS_STR \
 		"ai\0""autoindent\0" \
+		"esc\0""esctimeout\0" \
 		"et\0""expandtab\0" \
 		"fl\0""flash\0" \
+		"hls\0""hlsearch\0" \
 		"ic\0""ignorecase\0" \
+		"is\0""incsearch\0" \
+		"kitty\0""kittykeys\0" \
+		"nu\0""number\0" \
+		"rnu\0""relativenumber\0" \
+		"slow\0""slowopen\0" \
 		"sm\0""showmatch\0" \
-		"ts\0""tabstop\0"
+		"syn\0""syntax\0" \
+		"ts\0""tabstop\0" \
+		"tm\0""timeoutlen\0"
+	int gutter;             // width of line number column, 0 if not shown
 #else
 #define autoindent (0)
 #define expandtab  (0)
 #define err_method (0)
+#define hlsearch   (0)
 #define ignorecase (0)
+#define incsearch  (0)
+#define gutter     (0)
+#define slowopen   (0)
 #endif
 
 #if ENABLE_FEATURE_VI_READONLY
@@ -319,9 +452,20 @@ struct globals {
 	char *alt_filename;
 #endif
 	char *screenbegin;       // index into text[], of top line on the screen
+	int lnum_ofs, lnum_cnt;  // there are lnum_cnt NLs in text[0..lnum_ofs)
+	int lnum_hole, lnum_hole_len; // inserted text not yet counted
+	int *row_start;          // offsets in text[] of lines on screen rows
+	int row_alloc;           //  (end - text on rows past the end of text)
+	int row_valid;           // how many of row_start[] are up to date
 	char *screen;            // pointer to the virtual screen buffer
+	char *screen_attr;       //  attributes of its cells, ATTR_xxx
+#if ENABLE_FEATURE_VI_UTF8
+	unsigned *screen_wc;     //  chars of its CELL_UCS cells
+	smallint utf8;           // text[] is UTF-8
+#endif
 	int screensize;          //            and its size
 	int tabstop;
+	int timeoutlen;          // ms to wait for the rest of a :map lhs
 	int last_search_char;    // last char searched for (int because of Unicode)
 	smallint last_search_cmd;    // command used to invoke last char search
 #if ENABLE_FEATURE_VI_CRASHME
@@ -333,17 +477,95 @@ struct globals {
 
 #if ENABLE_FEATURE_VI_DOT_CMD
 	smallint adding2q;	 // are we currently adding user input to q
-	int lmc_len;             // length of last_modifying_cmd
-	char *ioq, *ioq_start;   // pointer to string for get_one_char to "read"
+	smallint dot_replay;     // the last key came from repeating a '.'
+	char *last_modifying_cmd; // last modifying cmd for "."
+	int lmc_len, lmc_size;   // its length, and the size of its buffer
+	char *ioq, *ioq_start;   // keys get_one_char() "reads" before stdin
+	int ioq_len, ioq_size;   // how many are left, size of ioq_start[]
+	int ioq_dot;             // how many of them repeat a '.'
 	int dotcnt;              // number of times to repeat '.' command
 #endif
+#if ENABLE_FEATURE_VI_MAP
+	struct map_node *maps;   // :map trie, [0]: its root, [1]: :map!'s
+	int map_nodes;           // how many nodes are used
+	int ioq_nore;            // how many queued keys mustn't be mapped
+	int pending_key;         // a key after ioq which no lhs has
+	smallint map_input;      // get_input_line() is reading
+	int no_mapping;          // get_arg_char() is reading
+#endif
+#if ENABLE_FEATURE_VI_MACRO
+	int ioq_macro;           // how many queued keys replay a @
+	char recording;          // register q is recording into, or 0
+	char last_macro;         // register of the last @, for @@
+	char *rec_buf;           // keys typed since q started
+	int rec_len, rec_size;
+#endif
+#if ENABLE_FEATURE_VI_PASTE
+	char *paste_buf;         // text of the last KEYCODE_PASTE
+	int paste_len;
+#endif
 #if ENABLE_FEATURE_VI_SEARCH
 	char *last_search_pattern; // last pattern from a '/' or '?' search
+# if ENABLE_FEATURE_VI_REGEX_SEARCH
+	struct rx_entry {	// patterns compiled lately, latest first
+		char *pat;
+		smallint icase;
+		struct regex *re;	// NULL if pat does not compile
+		const char *err;	//  and why
+	} rx_cache[4];
+# else
+	struct strsearch search_ss; // the last pattern char_search() prepared
+# endif
 #endif
 #if ENABLE_FEATURE_VI_SETOPTS
 	int char_insert__indentcol;		// column of recent autoindent or 0
 	int newindent;		// autoindent value for 'O'/'cc' commands
 						// or -1 to use indent from previous line
+	int showmatch_ofs;	// bracket for showmatch to point at, or -1
+#endif
+#if ENABLE_FEATURE_VI_SETOPTS && ENABLE_FEATURE_VI_SEARCH
+	struct hl_entry {	// hlsearch matches on a line of text[]
+		int start;	// offset of the line in text[]
+		int len;	// length of the line, without NL
+		unsigned gen;	// hl_gen the matches are for, 0 if invalid
+		unsigned used;	// hl_frame the line was last shown in
+		int cnt, alloc;	// match[] has cnt / 2 start, end pairs
+		int *match;	//  of offsets from start
+	} *hl_line;
+	int hl_alloc;
+	unsigned hl_gen;	// bumped when the pattern changes
+	unsigned hl_frame;	// bumped by each refresh()
+	char *hl_pat;		// pattern hl_line[] are for
+	smallint hl_icase;	//  and its ignorecase
+# if ENABLE_FEATURE_VI_REGEX_SEARCH
+	struct regex *hl_re;	// hl_pat compiled, NULL if it does not
+# else
+	struct strsearch hl_ss;	// hl_pat prepared for searching
+# endif
+	char *inc_pat;		// incsearch pattern typed so far, or NULL
+	char *inc_dot;		// dot before the '/' or '?'
+	char *inc_top;		//  and screenbegin
+	int inc_offset;		//  and offset
+	char *inc_from;		// where the search goes from
+	int inc_dir;
+	smallint inc_kind;	// pat_kind() of inc_pat
+	smallint inc_leg;	// 0: from inc_from on, 1: wrapped
+	smallint inc_done;	// inc_found is the match, or there is none
+	char *inc_at;		// inc_leg is looked through up to here
+	char *inc_found;
+	struct attr_span *row_spans; // attributes of the line being formatted
+	int row_spans_alloc;
+#endif
+#if ENABLE_FEATURE_VI_SYNTAX
+	const struct lang *syn_lang; // language of the file, or NULL
+	struct lex_ckpt {	// lexer state at the start of a line
+		int ofs;	//  which is at text[ofs]
+		int state;
+	} *syn_ckpt;		// [k] is for line k * SYN_STEP + 1
+	int syn_alloc, syn_valid;
+	int syn_dirty;		// text[] changed from here on, or -1
+	struct attr_span *syn_spans; // attributes of the line lexed last
+	int syn_nspans, syn_spans_alloc;
 #endif
 	smallint cmd_error;
 
@@ -353,6 +575,8 @@ struct globals {
 #endif
 	int refresh__old_offset;
 	int format_edit_status__tot;
+	unsigned timed_until;    // monotonic_ms() when timed_end is due
+	void (*timed_end)(void); // ends the visual effect on screen now
 
 	// a few references only
 #if ENABLE_FEATURE_VI_YANKMARK
@@ -372,12 +596,16 @@ struct globals {
 #endif
 #define STATUS_BUFFER_LEN  200
 	char status_buffer[STATUS_BUFFER_LEN]; // messages to the user
-#if ENABLE_FEATURE_VI_DOT_CMD
-	char last_modifying_cmd[MAX_INPUT_LEN];	// last modifying cmd for "."
+#if ENABLE_FEATURE_VI_SETOPTS
+	char status_shown[STATUS_BUFFER_LEN]; // status line on the terminal
 #endif
 	char get_input_line__buf[MAX_INPUT_LEN]; // former static
 
-	char scr_out_buf[MAX_SCR_COLS + MAX_TABSTOP * 2];
+	char scr_out_buf[MAX_GUTTER + MAX_SCR_COLS + MAX_TABSTOP * 2];
+	char scr_out_attr[MAX_GUTTER + MAX_SCR_COLS + MAX_TABSTOP * 2];
+#if ENABLE_FEATURE_VI_UTF8
+	unsigned scr_out_wc[MAX_GUTTER + MAX_SCR_COLS + MAX_TABSTOP * 2];
+#endif
 
 #if ENABLE_FEATURE_VI_UNDO
 // undo_push() operations
@@ -441,9 +669,28 @@ struct globals G;
 #define current_filename        (G.current_filename   )
 #define alt_filename            (G.alt_filename       )
 #define screen                  (G.screen             )
+#define screen_attr             (G.screen_attr        )
+#if ENABLE_FEATURE_VI_UTF8
+#define screen_wc               (G.screen_wc          )
+#define utf8                    (G.utf8               )
+#else
+#define utf8                    0
+#endif
 #define screensize              (G.screensize         )
 #define screenbegin             (G.screenbegin        )
+#define lnum_ofs                (G.lnum_ofs           )
+#define lnum_cnt                (G.lnum_cnt           )
+#define lnum_hole               (G.lnum_hole          )
+#define lnum_hole_len           (G.lnum_hole_len      )
+#define row_start               (G.row_start          )
+#define row_alloc               (G.row_alloc          )
+#define row_valid               (G.row_valid          )
+#if ENABLE_FEATURE_VI_SETOPTS
+#define gutter                  (G.gutter             )
+#define status_shown            (G.status_shown       )
+#endif
 #define tabstop                 (G.tabstop            )
+#define timeoutlen              (G.timeoutlen         )
 #define last_search_char        (G.last_search_char   )
 #define last_search_cmd         (G.last_search_cmd    )
 #if ENABLE_FEATURE_VI_CRASHME
@@ -455,18 +702,72 @@ struct globals G;
 #define readonly_mode           0
 #endif
 #define adding2q                (G.adding2q           )
+#define last_modifying_cmd      (G.last_modifying_cmd )
 #define lmc_len                 (G.lmc_len            )
+#define lmc_size                (G.lmc_size           )
+#define dot_replay              (G.dot_replay         )
 #define ioq                     (G.ioq                )
 #define ioq_start               (G.ioq_start          )
+#define ioq_len                 (G.ioq_len            )
+#define ioq_size                (G.ioq_size           )
+#define ioq_dot                 (G.ioq_dot            )
 #define dotcnt                  (G.dotcnt             )
+#define maps                    (G.maps               )
+#define map_nodes               (G.map_nodes          )
+#define ioq_nore                (G.ioq_nore           )
+#define pending_key             (G.pending_key        )
+#define map_input               (G.map_input          )
+#define no_mapping              (G.no_mapping         )
+#define ioq_macro               (G.ioq_macro          )
+#define recording               (G.recording          )
+#define last_macro              (G.last_macro         )
+#define rec_buf                 (G.rec_buf            )
+#define rec_len                 (G.rec_len            )
+#define rec_size                (G.rec_size           )
+#define paste_buf               (G.paste_buf          )
+#define paste_len               (G.paste_len          )
 #define last_search_pattern     (G.last_search_pattern)
+#define rx_cache                (G.rx_cache           )
+#define search_ss               (G.search_ss          )
 #define char_insert__indentcol  (G.char_insert__indentcol)
 #define newindent               (G.newindent          )
+#define showmatch_ofs           (G.showmatch_ofs      )
+#define hl_line                 (G.hl_line            )
+#define hl_alloc                (G.hl_alloc           )
+#define hl_gen                  (G.hl_gen             )
+#define hl_frame                (G.hl_frame           )
+#define hl_pat                  (G.hl_pat             )
+#define hl_icase                (G.hl_icase           )
+#define hl_re                   (G.hl_re              )
+#define hl_ss                   (G.hl_ss              )
+#define inc_pat                 (G.inc_pat            )
+#define inc_dot                 (G.inc_dot            )
+#define inc_top                 (G.inc_top            )
+#define inc_offset              (G.inc_offset         )
+#define inc_from                (G.inc_from           )
+#define inc_dir                 (G.inc_dir            )
+#define inc_kind                (G.inc_kind           )
+#define inc_leg                 (G.inc_leg            )
+#define inc_done                (G.inc_done           )
+#define inc_at                  (G.inc_at             )
+#define inc_found               (G.inc_found          )
+#define row_spans               (G.row_spans          )
+#define row_spans_alloc         (G.row_spans_alloc    )
+#define syn_lang                (G.syn_lang           )
+#define syn_ckpt                (G.syn_ckpt           )
+#define syn_alloc               (G.syn_alloc          )
+#define syn_valid               (G.syn_valid          )
+#define syn_dirty               (G.syn_dirty          )
+#define syn_spans               (G.syn_spans          )
+#define syn_nspans              (G.syn_nspans         )
+#define syn_spans_alloc         (G.syn_spans_alloc    )
 #define cmd_error               (G.cmd_error          )
 
 #define edit_file__cur_line     (G.edit_file__cur_line)
 #define refresh__old_offset     (G.refresh__old_offset)
 #define format_edit_status__tot (G.format_edit_status__tot)
+#define timed_until             (G.timed_until        )
+#define timed_end               (G.timed_end          )
 
 #define YDreg          (G.YDreg         )
 //#define Ureg           (G.Ureg          )
@@ -477,7 +778,8 @@ struct globals G;
 #define keep_index     (G.keep_index    )
 #define initial_cmds   (G.initial_cmds  )
 #define scr_out_buf    (G.scr_out_buf   )
-#define last_modifying_cmd  (G.last_modifying_cmd )
+#define scr_out_attr   (G.scr_out_attr  )
+#define scr_out_wc     (G.scr_out_wc    )
 #define get_input_line__buf (G.get_input_line__buf)
 
 #if ENABLE_FEATURE_VI_UNDO
@@ -545,18 +847,255 @@ static char *next_line(char *p) // return pointer first char next line
 	return p;
 }
 
+//----- Screen row table ---------------------------------------
+// row_start[] follows screenbegin: rows still on screen after
+// a scroll are kept, text changes drop the rows after them.
+static void rows_update(void)
+{
+	int n = rows - 1;
+	int sb = screenbegin - text;
+	int i, k;
+
+	if (n > row_alloc) {
+		row_start = xrealloc(row_start, n * sizeof(row_start[0]));
+		row_alloc = n;
+		row_valid = 0;
+	}
+	if (row_valid > n)
+		row_valid = n;
+	if (row_valid && row_start[0] != sb) {
+		if (sb > row_start[0]) {
+			// scrolled forward: the new top row may be known
+			for (k = 1; k < row_valid && row_start[k] < sb; k++)
+				continue;
+			if (k < row_valid && row_start[k] == sb) {
+				row_valid -= k;
+				memmove(row_start, row_start + k, row_valid * sizeof(row_start[0]));
+			} else {
+				row_valid = 0;
+			}
+		} else {
+			// scrolled back: walk down to the old top row
+			char *p = screenbegin;
+			for (k = 0; k < n && p - text < row_start[0]; k++) {
+				p = memchr(p, '\n', end - p);
+				p = p ? p + 1 : end;
+			}
+			if (k < n && p - text == row_start[0]) {
+				row_valid = MIN(row_valid, n - k);
+				memmove(row_start + k, row_start, row_valid * sizeof(row_start[0]));
+				row_valid += k;
+				p = screenbegin;
+				for (i = 0; i < k; i++) {
+					row_start[i] = p - text;
+					p = memchr(p, '\n', end - p);
+					p = p ? p + 1 : end;
+				}
+			} else {
+				row_valid = 0;
+			}
+		}
+	}
+	if (!row_valid) {
+		row_start[0] = sb;
+		row_valid = 1;
+	}
+	for (i = row_valid; i < n; i++) {
+		char *p = text + row_start[i - 1];
+		if (p < end) {
+			p = memchr(p, '\n', end - p);
+			p = p ? p + 1 : end;
+		}
+		row_start[i] = p - text;
+	}
+	row_valid = n;
+}
+
+// text[] is about to change at p
+static void rows_changed(char *p)
+{
+	// rows from the one starting at p on are found again, but
+	// for row 0: rows past the end all start there, and a line
+	// appended at the end moves all but the first of them
+	while (row_valid > 1 && row_start[row_valid - 1] >= p - text)
+		row_valid--;
+}
+
+// start of the text line on screen row li. Like next_line(),
+// stops at the last NL if the text ends above li.
+static char *screen_row(int li)
+{
+	char *p;
+
+	rows_update();
+	p = text + row_start[li];
+	if (p >= end && end > text)
+		p = end - 1;
+	return p;
+}
+
+//----- Search highlighting -----------------------------------
+// Matches of the last search pattern are looked for on the lines
+// shown only, and kept per line until the line or the pattern
+// changes. Line offsets follow text changes like the row table.
+#if ENABLE_FEATURE_VI_SETOPTS && ENABLE_FEATURE_VI_SEARCH
+static char *hl_match(char *p, char *stop, int *len);
+# if ENABLE_FEATURE_VI_REGEX_SEARCH
+static struct regex *get_regex(const char *pat, const char **err);
+# endif
+static int inc_begin(const char *prompt);
+static void inc_typed(const char *buf);
+static void inc_end(void);
+
+// text[] is about to change at p: 'size' bytes are inserted (> 0),
+// deleted (< 0), or changed in place up to who knows where (0)
+static void hl_changing(char *p, int size)
+{
+	struct hl_entry *h;
+	int o = p - text;
+
+	for (h = hl_line; h < hl_line + hl_alloc; h++) {
+		if (!h->gen)
+			continue;
+		if (size > 0) {
+			if (h->start > o) {
+				h->start += size;
+				continue;
+			}
+		} else if (size < 0) {
+			// the NL in front of a line belongs to it here
+			if (h->start > o - size) {
+				h->start += size;
+				continue;
+			}
+		}
+		if (h->start + h->len >= o)
+			h->gen = 0;
+	}
+}
+
+// forget all matches, text[] is reloaded
+static void hl_flush(void)
+{
+	free(hl_pat);
+	hl_pat = NULL;
+}
+
+static void hl_start_frame(void)
+{
+	const char *pat = last_search_pattern + 1;
+	IF_FEATURE_VI_REGEX_SEARCH(const char *err;)
+
+	hl_frame++;
+# if ENABLE_FEATURE_VI_REGEX_SEARCH
+	// the cache may have let go of it since the last frame
+	hl_re = get_regex(pat, &err);
+# endif
+	if (hl_alloc < 2 * rows) {
+		// room for the rows on screen and the rows scrolled off
+		hl_line = xrealloc(hl_line, 2 * rows * sizeof(hl_line[0]));
+		memset(hl_line + hl_alloc, 0, (2 * rows - hl_alloc) * sizeof(hl_line[0]));
+		hl_alloc = 2 * rows;
+	}
+	if (hl_pat && strcmp(hl_pat, pat) == 0 && hl_icase == ignorecase)
+		return;
+	free(hl_pat);
+	hl_pat = xstrdup(pat);
+	hl_icase = ignorecase;
+	if (++hl_gen == 0)
+		hl_gen++;
+# if !ENABLE_FEATURE_VI_REGEX_SEARCH
+	strsearch_init(&hl_ss, pat, ignorecase);
+# endif
+}
+
+// attributes of the line at p for format_line(): those
+// of 'under', with the matches on top
+static const struct attr_span *hl_spans(char *p, const struct attr_span *under)
+{
+	const struct attr_span *u;
+	struct hl_entry *h, *v = NULL;
+	struct attr_span *sp;
+	int o = p - text;
+	int i, n, a, in;
+
+	if (!hl_pat[0] || p >= end)
+		return under;
+	for (h = hl_line; h < hl_line + hl_alloc; h++) {
+		if (h->start == o && h->gen == hl_gen)
+			goto found;
+		// take an invalid entry, or the one unused for longest
+		if (h->used != hl_frame
+		 && (!v || (v->gen && (!h->gen || h->used < v->used)))
+		) {
+			v = h;
+		}
+	}
+	h = v;
+	h->start = o;
+	h->len = (char *)(memchr(p, '\n', end - p) ?: end) - p;
+	h->gen = hl_gen;
+	h->cnt = 0;
+	{
+		char *q = p, *eol = p + h->len;
+		int len;
+
+		while (q < eol && (q = hl_match(q, eol, &len)) != NULL) {
+			if (len == 0) {	// never highlighted
+				q++;
+				continue;
+			}
+			if (h->cnt + 2 > h->alloc) {
+				h->alloc = h->alloc * 2 + 8;
+				h->match = xrealloc(h->match, h->alloc * sizeof(h->match[0]));
+			}
+			h->match[h->cnt++] = q - p;
+			h->match[h->cnt++] = q - p + len;
+			q += len;
+		}
+	}
+ found:
+	h->used = hl_frame;
+
+	for (n = h->cnt + 1, u = under; u->pos != INT_MAX; u++)
+		n++;
+	if (row_spans_alloc < n) {
+		row_spans_alloc = n;
+		row_spans = xrealloc(row_spans, n * sizeof(row_spans[0]));
+	}
+	sp = row_spans;
+	a = ATTR_NORMAL;
+	in = 0;
+	i = 0;
+	for (;;) {
+		n = under->pos;
+		if (i < h->cnt && h->match[i] < n)
+			n = h->match[i];
+		if (n == INT_MAX)
+			break;
+		while (under->pos == n)
+			a = (under++)->attr;
+		// match starts and ends alternate
+		while (i < h->cnt && h->match[i] == n)
+			in = !(i++ & 1);
+		sp->pos = n;
+		sp->attr = in ? ATTR_SEARCH : a;
+		sp++;
+	}
+	sp->pos = INT_MAX;
+	sp->attr = ATTR_NORMAL;
+	return row_spans;
+}
+#else
+# define hl_changing(p, size) ((void)0)
+# define hl_flush() ((void)0)
+#endif
+
 //----- Text Information Routines ------------------------------
 static char *end_screen(void)
 {
-	char *q;
-	int cnt;
-
 	// find new bottom line
-	q = screenbegin;
-	for (cnt = 0; cnt < rows - 2; cnt++)
-		q = next_line(q);
-	q = end_line(q);
-	return q;
+	return end_line(screen_row(rows - 2));
 }
 
 // count line from start to stop
@@ -591,6 +1130,388 @@ static char *find_line(int li)	// find beginning of line #li
 	return q;
 }
 
+// count NLs in [p, q)
+static int count_nl(const char *p, const char *q)
+{
+	int cnt = 0;
+
+	while (p < q) {
+		p = memchr(p, '\n', q - p);
+		if (!p)
+			break;
+		cnt++;
+		p++;
+	}
+	return cnt;
+}
+
+// The line number anchor remembers how many NLs precede text[lnum_ofs].
+// Text changes before the anchor keep it up to date, so looking up
+// a line number costs only the distance from the previous lookup.
+static void lnum_flush_hole(void)
+{
+	if (lnum_hole_len) {
+		lnum_cnt += count_nl(text + lnum_hole, text + lnum_hole + lnum_hole_len);
+		lnum_hole_len = 0;
+	}
+}
+
+// a hole of 'size' bytes is being opened at p. Its contents are not
+// known yet, they are counted on next anchor update.
+static void lnum_insert(char *p, int size)
+{
+	lnum_flush_hole();
+	if (p - text < lnum_ofs) {
+		lnum_ofs += size;
+		lnum_hole = p - text;
+		lnum_hole_len = size;
+	}
+}
+
+// p through q, inclusive, are about to be deleted
+static void lnum_delete(char *p, char *q)
+{
+	lnum_flush_hole();
+	if (p - text >= lnum_ofs)
+		return;
+	if (q - text < lnum_ofs) {
+		lnum_cnt -= count_nl(p, q + 1);
+		lnum_ofs -= q - p + 1;
+	} else {
+		lnum_cnt -= count_nl(p, text + lnum_ofs);
+		lnum_ofs = p - text;
+	}
+}
+
+// text at p is about to be changed in place
+static void lnum_touch(char *p)
+{
+	lnum_delete(p, text + lnum_ofs);
+}
+
+static int line_number(char *p)	// 1-based line number of p
+{
+	lnum_flush_hole();
+	if (p - text >= lnum_ofs)
+		lnum_cnt += count_nl(text + lnum_ofs, p);
+	else
+		lnum_cnt -= count_nl(p, text + lnum_ofs);
+	lnum_ofs = p - text;
+	return lnum_cnt + 1;
+}
+
+//----- Syntax highlighting ------------------------------------
+// Lexer state is checkpointed every SYN_STEP lines, so a frame is
+// lexed from the checkpoint above screenbegin. A text change drops
+// the checkpoints below it on the next refresh().
+#if ENABLE_FEATURE_VI_SYNTAX
+enum {
+	SYN_STEP = 64,
+	SYN_COMMENT = 1,	// lexer state in a block comment; else 0,
+				// or the quote of a string going on
+	SYN_PREPROC = 1 << 0,	// '#' starts a preprocessor line
+	SYN_LONGSTR = 1 << 1,	// strings go on over NLs
+	SYN_WORDCMT = 1 << 2,	// line comment starts a word only
+};
+
+static const struct lang {
+	const char *suffixes;	// of file names, NUL separated
+	const char *keywords;	//  likewise
+	char comment[3];	// line comment
+	char block[5];		// block comment start and end
+	char quotes[4];
+	char flags;
+} syn_langs[] = {
+	{
+		".c\0.h\0.cc\0.cpp\0.hpp\0",
+		"auto\0break\0case\0char\0const\0continue\0default\0do\0"
+		"double\0else\0enum\0extern\0float\0for\0goto\0if\0inline\0"
+		"int\0long\0register\0return\0short\0signed\0sizeof\0static\0"
+		"struct\0switch\0typedef\0union\0unsigned\0void\0volatile\0"
+		"while\0",
+		"//", "/**/", "\"'", SYN_PREPROC
+	},
+	{
+		".sh\0.bash\0",
+		"case\0do\0done\0elif\0else\0esac\0export\0fi\0for\0function\0"
+		"if\0in\0local\0return\0select\0then\0until\0while\0",
+		"#", "", "\"'`", SYN_LONGSTR | SYN_WORDCMT
+	},
+	{
+		".conf\0.cfg\0.cnf\0.ini\0",
+		"",
+		"#", "", "\"", SYN_WORDCMT
+	},
+};
+
+// pick the language from the file name, or a "#!...sh" first line
+static void syn_select(void)
+{
+	const struct lang *sl;
+	const char *fn = current_filename;
+
+	syn_lang = NULL;
+	syn_valid = 1;
+	syn_dirty = -1;
+	if (!syn_ckpt) {
+		syn_alloc = 16;
+		syn_ckpt = xzalloc(syn_alloc * sizeof(syn_ckpt[0]));
+	}
+	for (sl = syn_langs; fn && sl < syn_langs + ARRAY_SIZE(syn_langs); sl++) {
+		const char *s = sl->suffixes;
+		int n = strlen(fn);
+
+		for (; *s; s += strlen(s) + 1) {
+			int k = strlen(s);
+			if (n > k && strcmp(fn + n - k, s) == 0) {
+				syn_lang = sl;
+				return;
+			}
+		}
+	}
+	if (end - text > 2 && text[0] == '#' && text[1] == '!') {
+		char *eol = memchr(text, '\n', end - text);
+		if (eol && eol - text > 2 && eol[-2] == 's' && eol[-1] == 'h')
+			syn_lang = &syn_langs[1];
+	}
+}
+
+static void syn_span(int pos, int attr)
+{
+	struct attr_span *sp = syn_spans + syn_nspans;
+
+	if (syn_nspans) {
+		if (sp[-1].attr == attr)
+			return;
+		if (sp[-1].pos == pos) {
+			sp[-1].attr = attr;
+			return;
+		}
+	}
+	if (syn_nspans + 2 > syn_spans_alloc) {
+		syn_spans_alloc = syn_spans_alloc * 2 + 16;
+		syn_spans = xrealloc(syn_spans, syn_spans_alloc * sizeof(syn_spans[0]));
+		sp = syn_spans + syn_nspans;
+	}
+	sp->pos = pos;
+	sp->attr = attr;
+	syn_nspans++;
+}
+
+static int is_word_char(int c)
+{
+	return isalnum(c) || c == '_';
+}
+
+// lex line 'ln', which starts at p, in lexer state *state.
+// Returns attributes of the line, *state becomes the state
+// at the start of the next line.
+static const struct attr_span *syn_lex(char *p, int *state, int ln)
+{
+	const struct lang *sl = syn_lang;
+	char *bol = p;
+	char *eol = memchr(p, '\n', end - p) ?: end;
+	int st = *state;
+	int base = ATTR_NORMAL;	// attribute outside comments and strings
+
+	syn_nspans = 0;
+	if (st == SYN_COMMENT)
+		syn_span(0, ATTR_COMMENT);
+	else if (st)
+		syn_span(0, ATTR_CONSTANT);
+	else if (sl->flags & SYN_PREPROC) {
+		char *q = skip_whitespace(p);
+		if (*q == '#') {
+			base = ATTR_PREPROC;
+			syn_span(q - bol, base);
+		}
+	}
+	while (p < eol) {
+		unsigned char c = *p;
+		char *q;
+
+		if (st == SYN_COMMENT) {
+			if (c == sl->block[2] && p[1] == sl->block[3]) {
+				p += 2;
+				st = 0;
+				syn_span(p - bol, base);
+			} else {
+				p++;
+			}
+			continue;
+		}
+		if (st) {	// in a string
+			if (c == '\\' && p + 1 < eol)
+				p++;
+			else if (c == st) {
+				st = 0;
+				syn_span(p + 1 - bol, base);
+			}
+			p++;
+			continue;
+		}
+		if (c == sl->comment[0]
+		 && (!sl->comment[1] || p[1] == sl->comment[1])
+		 && (!(sl->flags & SYN_WORDCMT) || p == bol || isspace((unsigned char)p[-1]))
+		) {
+			syn_span(p - bol, ATTR_COMMENT);
+			break;
+		}
+		if (sl->block[0] && c == sl->block[0] && p[1] == sl->block[1]) {
+			syn_span(p - bol, ATTR_COMMENT);
+			st = SYN_COMMENT;
+			p += 2;
+			continue;
+		}
+		if (c && strchr(sl->quotes, c)) {
+			syn_span(p - bol, ATTR_CONSTANT);
+			st = c;
+			p++;
+			continue;
+		}
+		if (!is_word_char(c)) {
+			p++;
+			continue;
+		}
+		for (q = p + 1; q < eol && is_word_char(*q); q++)
+			continue;
+		if (base == ATTR_NORMAL) {
+			if (isdigit(c)) {
+				syn_span(p - bol, ATTR_CONSTANT);
+				syn_span(q - bol, base);
+			} else if (q - p < 12) {
+				char word[12];
+
+				memcpy(word, p, q - p);
+				word[q - p] = '\0';
+				if (index_in_strings(sl->keywords, word) >= 0) {
+					syn_span(p - bol, ATTR_KEYWORD);
+					syn_span(q - bol, base);
+				}
+			}
+		}
+		p = q;
+	}
+	if (st != SYN_COMMENT && !(sl->flags & SYN_LONGSTR))
+		st = 0;
+	*state = st;
+	syn_span(INT_MAX, ATTR_NORMAL);
+
+	// keep a checkpoint if the next line is due one
+	if (ln % SYN_STEP == 0 && ln / SYN_STEP == syn_valid && eol < end) {
+		if (syn_valid == syn_alloc) {
+			syn_alloc *= 2;
+			syn_ckpt = xrealloc(syn_ckpt, syn_alloc * sizeof(syn_ckpt[0]));
+		}
+		syn_ckpt[syn_valid].ofs = eol + 1 - text;
+		syn_ckpt[syn_valid].state = st;
+		syn_valid++;
+	}
+	return syn_spans;
+}
+
+// Lex from the nearest checkpoint down to screenbegin.
+// Returns line number of screenbegin, *state is the state there
+static int syn_start_frame(int *state)
+{
+	int top = line_number(screenbegin);
+	int k, ln;
+	char *p;
+
+	if (syn_dirty >= 0) {
+		// checkpoints for lines up to the changed one are good
+		ln = line_number(text + MIN(syn_dirty, end - text));
+		syn_valid = MIN(syn_valid, (ln - 1) / SYN_STEP + 1);
+		syn_dirty = -1;
+	}
+	k = MIN((top - 1) / SYN_STEP, syn_valid - 1);
+	ln = k * SYN_STEP + 1;
+	p = text + syn_ckpt[k].ofs;
+	*state = syn_ckpt[k].state;
+	for (; ln < top; ln++) {
+		syn_lex(p, state, ln);
+		p = memchr(p, '\n', end - p) + 1;
+	}
+	return top;
+}
+
+// text[] is about to change at p
+static void syn_changing(char *p)
+{
+	if (syn_dirty < 0 || p - text < syn_dirty)
+		syn_dirty = p - text;
+}
+#else
+# define syn_select() ((void)0)
+# define syn_changing(p) ((void)0)
+#endif
+
+// text[] is about to change at p: 'size' bytes are inserted (> 0),
+// deleted (< 0), or changed in place, maybe adding or removing NLs (0)
+static void text_changing(char *p, int size)
+{
+	if (size > 0)
+		lnum_insert(p, size);
+	else if (size < 0)
+		lnum_delete(p, p - size - 1);
+	else
+		lnum_touch(p);
+	rows_changed(p);
+	hl_changing(p, size);
+	syn_changing(p);
+}
+
+#if ENABLE_FEATURE_VI_UTF8
+// Screen cells of a non-ASCII char are CELL_UCS, with the char
+// in screen_wc[], and CELL_UCS_CONT for the right half of a wide one
+enum {
+	CELL_UCS = 0x80,
+	CELL_UCS_CONT,
+};
+
+// start of the char p is in
+static char *char_start(char *p)
+{
+	char *q = p;
+	unsigned wc;
+
+	if (!utf8)
+		return p;
+	while (q > text && p - q < 3 && ((unsigned char)*q & 0xc0) == 0x80)
+		q--;
+	if (q != p && utf8_decode(q, end, &wc) > p - q)
+		return q;
+	return p;
+}
+
+// length of the char at p
+static int char_len(const char *p)
+{
+	unsigned wc;
+
+	if (!utf8 || !(*p & 0x80))
+		return 1;
+	return utf8_decode(p, end, &wc) ?: 1;
+}
+
+// columns taken by the non-ASCII byte at p
+static int utf8_columns(char *p)
+{
+	unsigned wc;
+	int n;
+
+	if (((unsigned char)*p & 0xc0) == 0x80)
+		return char_start(p) == p;	// inside a char, or shown as '.'
+	n = utf8_decode(p, end, &wc);
+	if (n == 0 || wc < 0xa0)
+		return 1;
+	return unicode_width(wc);
+}
+#else
+# define char_start(p) (p)
+# define char_len(p) 1
+#endif
+
 static int next_tabstop(int col)
 {
 	return col + ((tabstop - 1) - (col % tabstop));
@@ -601,22 +1522,36 @@ static int prev_tabstop(int col)
 	return col - ((col % tabstop) ?: tabstop);
 }
 
-static int next_column(char c, int co)
+// column after the char at p, which starts in column co
+static int next_column(char *p, int co)
 {
+	unsigned char c = *p;
+
 	if (c == '\t')
 		co = next_tabstop(co);
-	else if ((unsigned char)c < ' ' || c == 0x7f)
+	else if (c < ' ' || c == 0x7f)
 		co++; // display as ^X, use 2 columns
+#if ENABLE_FEATURE_VI_UTF8
+	else if ((c & 0x80) && utf8)
+		return co + utf8_columns(p);
+#endif
 	return co + 1;
 }
 
 static int get_column(char *p)
 {
-	const char *r;
+	char *r;
 	int co = 0;
 
-	for (r = begin_line(p); r < p; r++)
-		co = next_column(*r, co);
+	for (r = begin_line(p); r < p; r++) {
+		// plain ASCII takes a column a byte
+		int n = printable_ascii_len(r, p - r);
+		co += n;
+		r += n;
+		if (r == p)
+			break;
+		co = next_column(r, co);
+	}
 	return co;
 }
 
@@ -624,6 +1559,7 @@ static int get_column(char *p)
 static void screen_erase(void)
 {
 	memset(screen, ' ', screensize);	// clear new screen
+	memset(screen_attr, ATTR_NORMAL, screensize);
 }
 
 static void new_screen(int ro, int co)
@@ -632,7 +1568,12 @@ static void new_screen(int ro, int co)
 
 	free(screen);
 	screensize = ro * co + 8;
-	s = screen = xmalloc(screensize);
+	s = screen = xmalloc(screensize * 2);
+	screen_attr = screen + screensize;
+#if ENABLE_FEATURE_VI_UTF8
+	free(screen_wc);
+	screen_wc = xzalloc(screensize * sizeof(screen_wc[0]));
+#endif
 	// initialize the new screen. assume this will be a empty file.
 	screen_erase();
 	// non-existent text[] lines start with a tilde (~).
@@ -677,35 +1618,37 @@ static void sync_cursor(char *d, int *row, int *col)
 			cnt = count_lines(end_scr, beg_cur);
 			if (cnt > (rows - 1) / 2)
 				goto sc1;	// too many lines
-			for (ro = 0; ro < cnt - 1; ro++) {
-				// move screen begin the same amount
-				screenbegin = next_line(screenbegin);
-				// now, move the end of screen
-				end_scr = next_line(end_scr);
-				end_scr = end_line(end_scr);
-			}
+			// move screen begin the same amount
+			screenbegin = text + row_start[cnt - 1];
 		}
 	}
 	// "d" is on screen- find out which row
-	tp = screenbegin;
+	rows_update();
 	for (ro = 0; ro < rows - 1; ro++) {	// drive "ro" to correct row
-		if (tp == beg_cur)
+		if (text + row_start[ro] == beg_cur)
 			break;
-		tp = next_line(tp);
 	}
+	tp = beg_cur;
 
 	// find out what col "d" is on
 	co = 0;
-	do { // drive "co" to correct column
+	for (;;) { // drive "co" to correct column
 		if (*tp == '\n') //vda || *tp == '\0')
 			break;
-		co = next_column(*tp, co) - 1;
+		co = next_column(tp, co) - 1;
 		// inserting text before a tab, don't include its position
 		if (cmd_mode && tp == d - 1 && *d == '\t') {
 			co++;
 			break;
 		}
-	} while (tp++ < d && ++co);
+		if (tp++ >= d)
+			break;
+		// the next char starts past this one, even if
+		// this one has no width (co is -1 then)
+		co++;
+	}
+	if (co < 0)	// on a combining char at the start of the line
+		co = 0;
 
 	// "co" is the column where "dot" is.
 	// The screen has "columns" columns.
@@ -723,8 +1666,8 @@ static void sync_cursor(char *d, int *row, int *col)
 	if (co < 0 + offset) {
 		offset = co;
 	}
-	if (co >= columns + offset) {
-		offset = co - columns + 1;
+	if (co >= columns - gutter + offset) {
+		offset = co - (columns - gutter) + 1;
 	}
 	// if the first char of the line is a tab, and "dot" is sitting on it
 	//  force offset to 0.
@@ -734,36 +1677,86 @@ static void sync_cursor(char *d, int *row, int *col)
 	co -= offset;
 
 	*row = ro;
-	*col = co;
+	*col = co + gutter;	// line numbers are to the left of text
 }
 
 //----- Format a text[] line into a buffer ---------------------
-static char* format_line(char *src /*, int li*/)
+// lnum is the number to show in the gutter, -1 for none
+// format the line at src into scr_out_buf[], and the attributes
+// of its cells from 'sp' into scr_out_attr[] at the same index
+static char* format_line(char *src, int lnum, const struct attr_span *sp)
 {
 	unsigned char c;
-	int co;
+	int co, n;
 	int ofs = offset;
-	char *dest = scr_out_buf; // [MAX_SCR_COLS + MAX_TABSTOP * 2]
+	int cols = columns - gutter; // width of text area
+	// tabstop - 1 if it is a power of two, for co % tabstop
+	int tabmask = (tabstop & (tabstop - 1)) ? 0 : tabstop - 1;
+	// [MAX_GUTTER + MAX_SCR_COLS + MAX_TABSTOP * 2]
+	char *dest = scr_out_buf + MAX_GUTTER;
+	char *adest = scr_out_attr + MAX_GUTTER;
+#if ENABLE_FEATURE_VI_UTF8
+	unsigned *wdest = scr_out_wc + MAX_GUTTER;
+#endif
+	char *bol = src;
+	char a = ATTR_NORMAL;
 
 	c = '~'; // char in col 0 in non-existent lines is '~'
 	co = 0;
-	while (co < columns + tabstop) {
+	while (co < cols + tabstop) {
 		// have we gone past the end?
 		if (src < end) {
+			while (src - bol >= sp->pos)
+				a = (sp++)->attr;
+			// copy a run of plain ASCII in one go, up to the next
+			// change of attribute
+			n = printable_ascii_len(src, MIN(end - src, cols + tabstop - co));
+			if (n) {
+				if (n > sp->pos - (src - bol))
+					n = sp->pos - (src - bol);
+				memcpy(dest + co, src, n);
+				memset(adest + co, a, n);
+				src += n;
+				co += n;
+				goto scroll;
+			}
 			c = *src++;
 			if (c == '\n')
 				break;
+#if ENABLE_FEATURE_VI_UTF8
+			if ((c & 0x80) && utf8) {
+				unsigned wc;
+				int n = utf8_decode((char *)src - 1, end, &wc);
+
+				c = '.';
+				if (n && wc >= 0xa0) {
+					src += n - 1;
+					n = unicode_width(wc);
+					if (n == 0)	// combining chars are not shown
+						goto next;
+					wdest[co] = wc;
+					c = CELL_UCS;
+					if (n == 2) {
+						adest[co] = a;
+						dest[co++] = c;
+						c = CELL_UCS_CONT;
+					}
+				}
+			} else
+#endif
 			if ((c & 0x80) && !Isprint(c)) {
 				c = '.';
 			}
 			if (c < ' ' || c == 0x7f) {
 				if (c == '\t') {
 					c = ' ';
-					//      co %    8     !=     7
-					while ((co % tabstop) != (tabstop - 1)) {
-						dest[co++] = c;
-					}
+					// blanks up to the last column of the tab
+					n = tabmask ? ~co & tabmask : tabstop - 1 - co % tabstop;
+					memset(dest + co, c, n);
+					memset(adest + co, a, n);
+					co += n;
 				} else {
+					adest[co] = a;
 					dest[co++] = '^';
 					if (c == 0x7f)
 						c = '?';
@@ -771,15 +1764,27 @@ static char* format_line(char *src /*, int li*/)
 						c += '@'; // Ctrl-X -> 'X'
 				}
 			}
+		} else {
+			a = ATTR_NORMAL;
 		}
+		adest[co] = a;
 		dest[co++] = c;
+ scroll:
 		// discard scrolled-off-to-the-left portion,
 		// in tabstop-sized pieces
 		if (ofs >= tabstop && co >= tabstop) {
-			memmove(dest, dest + tabstop, co);
-			co -= tabstop;
-			ofs -= tabstop;
+			n = MIN(ofs, co) / tabstop * tabstop;
+			co -= n;
+			ofs -= n;
+			memmove(dest, dest + n, co);
+			memmove(adest, adest + n, co);
+#if ENABLE_FEATURE_VI_UTF8
+			memmove(wdest, wdest + n, co * sizeof(wdest[0]));
+#endif
 		}
+#if ENABLE_FEATURE_VI_UTF8
+ next:
+#endif
 		if (src >= end)
 			break;
 	}
@@ -789,12 +1794,63 @@ static char* format_line(char *src /*, int li*/)
 	// discard last scrolled off part
 	co -= ofs;
 	dest += ofs;
+	adest += ofs;
+#if ENABLE_FEATURE_VI_UTF8
+	// blank out halves of wide chars at the edges
+	if ((unsigned char)dest[0] == CELL_UCS_CONT)
+		dest[0] = ' ';
+	if (co > cols && (unsigned char)dest[cols] == CELL_UCS_CONT)
+		dest[cols - 1] = ' ';
+#endif
 	// fill the rest with spaces
-	if (co < columns)
-		memset(&dest[co], ' ', columns - co);
+	if (co < cols) {
+		memset(&dest[co], ' ', cols - co);
+		memset(&adest[co], ATTR_NORMAL, cols - co);
+	}
+#if ENABLE_FEATURE_VI_SETOPTS
+	if (gutter) {
+		// right-aligned number and a blank, in front of the text
+		char *d = dest - 1;
+		dest -= gutter;
+		memset(dest, ' ', gutter);
+		memset(adest - gutter, ATTR_NORMAL, gutter);
+		if (lnum >= 0) {
+			do {
+				*--d = '0' + lnum % 10;
+				lnum /= 10;
+			} while (lnum);
+		}
+	}
+#endif
 	return dest;
 }
 
+// write n cells of screen[] from index pos on to the terminal
+static void put_cells(int pos, int n)
+{
+	const char *s = screen + pos;
+
+#if ENABLE_FEATURE_VI_UTF8
+	while (utf8 && n > 0) {
+		char buf[4];
+		int k = printable_ascii_len(s, n);
+
+		fwrite(s, k, 1, stdout);
+		if (k < n) {
+			if ((unsigned char)s[k] == CELL_UCS)
+				fwrite(buf, utf8_encode(buf, screen_wc[pos + k]), 1, stdout);
+			else if ((unsigned char)s[k] != CELL_UCS_CONT)
+				bb_putchar(s[k]);
+			k++;
+		}
+		s += k;
+		pos += k;
+		n -= k;
+	}
+#endif
+	fwrite(s, n, 1, stdout);
+}
+
 //----- Refresh the changed screen lines -----------------------
 // Copy the source line from text[] into the buffer and note
 // if the current screenline is different from the new buffer.
@@ -804,44 +1860,120 @@ static void refresh(int full_screen)
 {
 #define old_offset refresh__old_offset
 
-	int li, changed;
-	char *tp, *sp;		// pointer into text[] and screen[]
+	static const struct attr_span plain = { INT_MAX, ATTR_NORMAL };
+	int li, changed, drawn = 0;
+	char *tp, *sp, *sa;	// pointer into text[], screen[] and screen_attr[]
+	const struct attr_span *spans;
+#if ENABLE_FEATURE_VI_UTF8
+	unsigned *sw, *out_wc;
+# define WC_DIFFER(i) ((unsigned char)out_buf[i] == CELL_UCS && out_wc[i] != sw[i])
+#else
+# define WC_DIFFER(i) 0
+#endif
+#if ENABLE_FEATURE_VI_SETOPTS
+	int lnum;		// number of top line on the screen
+#endif
+#if ENABLE_FEATURE_VI_SYNTAX
+	int top = 0, state = 0;	// for syn_lex()
+#endif
 
+#if ENABLE_FEATURE_VI_MACRO
+	if (ioq_macro) {
+		// while a @ replays keys, only keep up with dot: the
+		// screen is drawn once, when it is done
+		sync_cursor(dot, &crow, &ccol);
+		if (!keep_index)
+			cindex = ccol - gutter + offset;
+		return;
+	}
+#endif
+#if !ENABLE_FEATURE_VI_USE_SIGNALS
+	// no SIGWINCH to tell us, ask every time
 	if (ENABLE_FEATURE_VI_WIN_RESIZE IF_FEATURE_VI_ASK_TERMINAL(&& !T.get_rowcol_error) ) {
-		unsigned c = columns, r = rows;
+		int c = columns, r = rows;
 		query_screen_dimensions();
-#if ENABLE_FEATURE_VI_USE_SIGNALS
-		full_screen |= (c - columns) | (r - rows);
-#else
 		if (c != columns || r != rows) {
 			full_screen = TRUE;
 			// update screen memory since SIGWINCH won't have done it
 			new_screen(rows, columns);
 		}
-#endif
 	}
+#endif
 	sync_cursor(dot, &crow, &ccol);	// where cursor will be (on "dot")
-	tp = screenbegin;	// index into text[] of top line
+#if ENABLE_FEATURE_VI_SETOPTS
+	lnum = 0;
+	if (shownumber || relativenumber) {
+		int w, n;
+
+		lnum = line_number(screenbegin);
+		// wide enough for the bottom line, at least 3 digits
+		w = 3;
+		for (n = lnum + rows - 2; n >= 1000; n /= 10)
+			w++;
+		w++;
+		if (w >= columns / 2)
+			w = 0;	// no room left for text
+		if (w != gutter) {
+			gutter = w;
+			sync_cursor(dot, &crow, &ccol);	// text area width changed
+		}
+	} else if (gutter) {
+		gutter = 0;
+		sync_cursor(dot, &crow, &ccol);
+	}
+#endif
+	// sync_cursor() brought row_start[] up to date
+#if ENABLE_FEATURE_VI_SETOPTS && ENABLE_FEATURE_VI_SEARCH
+	if (hlsearch)
+		hl_start_frame();
+#endif
+#if ENABLE_FEATURE_VI_SYNTAX
+	if (syntax && syn_lang)
+		top = syn_start_frame(&state);
+#endif
 
 	// compare text[] to screen[] and mark screen[] lines that need updating
 	for (li = 0; li < rows - 1; li++) {
 		int cs, ce;				// column start & end
-		char *out_buf;
-		// format current text line
-		out_buf = format_line(tp /*, li*/);
+		char *out_buf, *out_attr;
+		int n = -1;
 
-		// skip to the end of the current text[] line
-		if (tp < end) {
-			char *t = memchr(tp, '\n', end - tp);
-			if (!t) t = end - 1;
-			tp = t + 1;
+		tp = text + row_start[li];	// index into text[] of this line
+#if ENABLE_FEATURE_VI_SETOPTS
+		if (gutter && tp < end) {
+			n = lnum + li;
+			if (relativenumber) {
+				n = li - crow;
+				if (n < 0)
+					n = -n;
+				else if (n == 0 && shownumber)
+					n = lnum + li;
+			}
 		}
+#endif
+		spans = &plain;
+#if ENABLE_FEATURE_VI_SYNTAX
+		if (syntax && syn_lang && tp < end)
+			spans = syn_lex(tp, &state, top + li);
+#endif
+#if ENABLE_FEATURE_VI_SETOPTS && ENABLE_FEATURE_VI_SEARCH
+		if (hlsearch)
+			spans = hl_spans(tp, spans);
+#endif
+		// format current text line
+		out_buf = format_line(tp, n, spans);
+		out_attr = scr_out_attr + (out_buf - scr_out_buf);
+#if ENABLE_FEATURE_VI_UTF8
+		out_wc = scr_out_wc + (out_buf - scr_out_buf);
+		sw = &screen_wc[li * columns];
+#endif
 
 		// see if there are any changes between virtual screen and out_buf
 		changed = FALSE;	// assume no change
 		cs = 0;
 		ce = columns - 1;
 		sp = &screen[li * columns];	// start of screen line
+		sa = &screen_attr[li * columns];
 		if (full_screen) {
 			// force re-draw of every single column from 0 - columns-1
 			goto re0;
@@ -849,7 +1981,7 @@ static void refresh(int full_screen)
 		// compare newly formatted buffer with virtual screen
 		// look forward for first difference between buf and screen
 		for (; cs <= ce; cs++) {
-			if (out_buf[cs] != sp[cs]) {
+			if (out_buf[cs] != sp[cs] || out_attr[cs] != sa[cs] || WC_DIFFER(cs)) {
 				changed = TRUE;	// mark for redraw
 				break;
 			}
@@ -857,7 +1989,7 @@ static void refresh(int full_screen)
 
 		// look backward for last difference between out_buf and screen
 		for (; ce >= cs; ce--) {
-			if (out_buf[ce] != sp[ce]) {
+			if (out_buf[ce] != sp[ce] || out_attr[ce] != sa[ce] || WC_DIFFER(ce)) {
 				changed = TRUE;	// mark for redraw
 				break;
 			}
@@ -874,23 +2006,57 @@ static void refresh(int full_screen)
 		if (cs < 0) cs = 0;
 		if (ce > columns - 1) ce = columns - 1;
 		if (cs > ce) { cs = 0; ce = columns - 1; }
+#if ENABLE_FEATURE_VI_UTF8
+		// start drawing a wide char from its left half
+		if (cs > 0 && (unsigned char)out_buf[cs] == CELL_UCS_CONT)
+			cs--;
+#endif
 		// is there a change between virtual screen and out_buf
 		if (changed) {
+			int i;
+
 			// copy changed part of buffer to virtual screen
 			memcpy(sp+cs, out_buf+cs, ce-cs+1);
+			memcpy(sa+cs, out_attr+cs, ce-cs+1);
+#if ENABLE_FEATURE_VI_UTF8
+			memcpy(sw+cs, out_wc+cs, (ce-cs+1) * sizeof(sw[0]));
+#endif
+			// show the whole update at once, where the terminal can
+			if (!drawn++)
+				sync_output(1);
 			place_cursor(li, cs);
-			// write line out to terminal
-			fwrite(&sp[cs], ce - cs + 1, 1, stdout);
+			// write line out to terminal, a run of same attribute cells
+			// at a time
+			for (; cs <= ce; cs = i) {
+				for (i = cs + 1; i <= ce && sa[i] == sa[cs]; i++)
+					continue;
+				set_attr(sa[cs]);
+				if (slowopen && i > ce && sa[cs] == ATTR_NORMAL
+				 && (!utf8 || (int)printable_ascii_len(&sp[cs], i - cs) == i - cs)
+				) {
+					// can trailing blanks be erased to end of line?
+					char *t = sp + i;
+					while (t < sp + columns && *t == ' ' && !sa[t - sp])
+						t++;
+					write_span(&sp[cs], i - cs, t == sp + columns);
+				} else {
+					put_cells(li * columns + cs, i - cs);
+				}
+			}
+			set_attr(ATTR_NORMAL);
 		}
 	}
 
 	place_cursor(crow, ccol);
+	if (drawn)
+		sync_output(0);
 
 	if (!keep_index)
-		cindex = ccol + offset;
+		cindex = ccol - gutter + offset;
 
 	old_offset = offset;
 #undef old_offset
+#undef WC_DIFFER
 }
 
 //----- Force refresh of all Lines -----------------------------
@@ -904,15 +2070,49 @@ static void redraw(int full_screen)
 	show_status_line();
 }
 
+//----- Timed screen effects -----------------------------------
+// An effect stays on screen while we wait for input: the next key
+// or its timeout, whichever comes first, ends it.
+static void end_timed(void)
+{
+	void (*fn)(void) = timed_end;
+
+	if (fn) {
+		timed_end = NULL;
+		fn();
+	}
+}
+
+static void start_timed(void (*fn)(void), int ms)
+{
+	if (timed_end != fn)
+		end_timed();
+	timed_end = fn;
+	timed_until = (unsigned)monotonic_ms() + ms;
+}
+
 //----- Flash the screen  --------------------------------------
+static void flash_end(void)
+{
+	reverse_video_end();
+}
+
 static void flash(int h)
 {
-	standout_start();
-	redraw(TRUE);
-	mysleep(h);
-	standout_end();
-	redraw(TRUE);
+	if (timed_end != flash_end)
+		reverse_video_start();
+	start_timed(flash_end, h * 10);
+}
+
+#if ENABLE_FEATURE_VI_DOT_CMD
+// Drop the queued keys: ^C or an error stops a '.', @ or mapping
+static void ioq_flush(void)
+{
+	ioq_len = ioq_dot = 0;
+	IF_FEATURE_VI_MAP(ioq_nore = 0;)
+	IF_FEATURE_VI_MACRO(ioq_macro = 0;)
 }
+#endif
 
 static void indicate_error(void)
 {
@@ -921,6 +2121,10 @@ static void indicate_error(void)
 		return;
 #endif
 	cmd_error = TRUE;
+#if ENABLE_FEATURE_VI_MACRO
+	if (ioq_macro)
+		ioq_flush();	// the rest of the @ would go astray
+#endif
 	if (!err_method) {
 		bell();
 	} else {
@@ -929,10 +2133,72 @@ static void indicate_error(void)
 }
 
 //----- IO Routines --------------------------------------------
+#if ENABLE_FEATURE_VI_PASTE
+// Keep pasted text for paste_insert(). Terminals send Enter as CR,
+// in a paste too: turn CR and CR LF into NL.
+static void got_paste(char *buf)
+{
+	char *src, *dst, *e = buf + paste_len;
+
+	for (src = dst = buf; src < e; src++) {
+		if (*src == '\r') {
+			if (src + 1 < e && src[1] == '\n')
+				continue;
+			*src = '\n';
+		}
+		*dst++ = *src;
+	}
+	*dst = '\0';
+	paste_len = dst - buf;
+	free(paste_buf);
+	paste_buf = buf;
+}
+#endif
+
+#if ENABLE_FEATURE_VI_DOT_CMD
+// Add keys to a buffer of them which grows as needed. It is kept
+// for the next time, so remembering keys seldom allocates.
+static void keys_add(char **buf, int *len, int *size, const char *s, int n)
+{
+	if (*len + n > *size) {
+		*size = 2 * *size + n;
+		*buf = xrealloc(*buf, *size);
+	}
+	memcpy(*buf + *len, s, n);
+	*len += n;
+}
+#endif
+
+#if ENABLE_FEATURE_VI_MACRO
+# define rec_add(s, n) keys_add(&rec_buf, &rec_len, &rec_size, s, n)
+
+// Add a typed key to what q records. A register holds bytes: the
+// text of a paste goes in as typed, other special keys are lost.
+static void record_key(int c)
+{
+	char ch = c;
+
+# if ENABLE_FEATURE_VI_PASTE
+	if (c == KEYCODE_PASTE)
+		rec_add(paste_buf, strnlen(paste_buf, paste_len));
+	else
+# endif
+	if (c > 0 && c <= 0xff)
+		rec_add(&ch, 1);
+}
+#endif
+
 static int readit(void) // read (maybe cursor) key from stdin
 {
-	int c;
+	int64_t c;
 
+	// keep a timed effect up until it expires or a key comes in
+	while (timed_end && !readbuffer[0]) {
+		int left = (int)(timed_until - (unsigned)monotonic_ms());
+		if (left <= 0 || mysleep((left + 9) / 10))
+			break;
+	}
+	end_timed();
 	fflush_all();
 
 	// Wait for input. TIMEOUT = -1 makes read_key wait even
@@ -947,48 +2213,286 @@ static int readit(void) // read (maybe cursor) key from stdin
 		cookmode(); // terminal to "cooked"
 		bb_simple_error_msg_and_die("can't read user input");
 	}
-	return c;
+#if ENABLE_FEATURE_VI_ASK_TERMINAL
+	if ((int32_t)c == KEYCODE_CURSOR_POS) {
+		// the size init_term() asked for
+		cursor_report(c);
+		new_screen(rows, columns);
+		redraw(TRUE);
+		goto again;
+	}
+#endif
+#if ENABLE_FEATURE_VI_PASTE
+	if (c == KEYCODE_PASTE) {
+		got_paste(read_paste(STDIN_FILENO, readbuffer, &paste_len));
+	} else if (cmd_mode == 1 && ((c >= ' ' && c < 0x7f) || c >= 0x80
+	                             || c == '\t' || c == '\r' || c == '\n')
+	) {
+		// a paste without brackets: more text than anyone could type
+		int len = PASTE_BURST;
+		char *s = read_burst(STDIN_FILENO, readbuffer, &len);
+
+		if (s) {
+			char *buf = xmalloc(len + 2);
+			buf[0] = c;
+			memcpy(buf + 1, s, len);
+			paste_len = len + 1;
+			got_paste(buf);
+			c = KEYCODE_PASTE;
+		}
+	}
+#endif
+#if ENABLE_FEATURE_VI_MACRO
+	if (recording)
+		record_key(c);
+#endif
+	return (int)c;
 }
 
 #if ENABLE_FEATURE_VI_DOT_CMD
+// Make room in ioq_start[] for 'before' more keys in front of the
+// queued ones and 'after' more behind them. The buffer is kept for
+// the next time, so queueing keys seldom allocates.
+static void ioq_room(int before, int after)
+{
+	char *p = ioq_start;
+	int size = ioq_size;
+
+	if (ioq - ioq_start >= before
+	 && ioq_start + ioq_size - (ioq + ioq_len) >= after
+	) {
+		return;
+	}
+	if (before + ioq_len + after > size) {
+		size = 2 * size + before + ioq_len + after;
+		p = xmalloc(size);
+	}
+	// leave as much room in front as behind
+	memmove(p + before + (size - before - ioq_len - after) / 2, ioq, ioq_len);
+	ioq = p + before + (size - before - ioq_len - after) / 2;
+	if (p != ioq_start) {
+		free(ioq_start);
+		ioq_start = p;
+		ioq_size = size;
+	}
+}
+
+// get_one_char() returns s[len] next, before what is queued
+static void ioq_push(const char *s, int len)
+{
+	ioq_room(len, 0);
+	ioq -= len;
+	ioq_len += len;
+	memcpy(ioq, s, len);
+	// what a @ does, like a '.' or :map in it, is part of the @
+	IF_FEATURE_VI_MACRO(if (ioq_macro) ioq_macro += len;)
+}
+
+# if ENABLE_FEATURE_VI_MAP
+// Maps of this mode: :map in command mode, :map! in insert mode
+// and on the command line
+static int map_root(void)
+{
+	return cmd_mode != 0 || map_input;
+}
+
+static int map_child(int n, unsigned char key)
+{
+	for (n = maps[n].child; n; n = maps[n].next)
+		if (maps[n].key == key)
+			break;
+	return n;
+}
+
+// Map lhs to rhs, or if rhs is NULL unmap it. Returns 0 if there is
+// no such lhs to unmap.
+static int map_set(int root, const char *lhs, const char *rhs, int nore)
+{
+	int path[MAX_INPUT_LEN];
+	int i, n = root, len = strlen(lhs);
+
+	if (!maps) {
+		maps = xzalloc(16 * sizeof(maps[0]));
+		map_nodes = 2;
+	}
+	for (i = 0; i < len; i++) {
+		int c = map_child(n, lhs[i]);
+		if (!c) {
+			if (!rhs)
+				return 0;
+			if ((map_nodes & 15) == 0)
+				maps = xrealloc(maps, (map_nodes + 16) * sizeof(maps[0]));
+			c = map_nodes++;
+			memset(&maps[c], 0, sizeof(maps[c]));
+			maps[c].key = lhs[i];
+			maps[c].next = maps[n].child;
+			maps[n].child = c;
+		}
+		path[i] = n = c;
+	}
+	if (!rhs && !maps[n].rhs)
+		return 0;
+	if (!rhs != !maps[n].rhs) {
+		// a lhs is added or gone: count it on the way to it
+		int d = rhs ? 1 : -1;
+		maps[root].count += d;
+		for (i = 0; i < len; i++)
+			maps[path[i]].count += d;
+	}
+	free(maps[n].rhs);
+	maps[n].rhs = rhs ? xstrdup(rhs) : NULL;
+	maps[n].nore = nore;
+	return 1;
+}
+
+// If a lhs is at the head of the queue, replace it with its rhs and
+// return 1. Keys typed while it could still become a (longer) lhs
+// are queued, each waited for up to 'timeoutlen' ms.
+static int map_expand(void)
+{
+	int root = map_root();
+	int n = 0, node = root, len = 0;
+	struct map_node *m = NULL;
+
+	if (!maps || !maps[root].count || ioq_nore || no_mapping)
+		return 0;
+	for (;;) {
+		if (n == ioq_len) {
+			int c;
+
+			// the first key is waited for as long as it takes
+			if (pending_key
+			 || (n && !readbuffer[0] && !mysleep(timeoutlen / 10))
+			) {
+				break;
+			}
+			c = readit();
+			if (c < 0 || c > 0xff) {
+				pending_key = c;	// no lhs has it
+				break;
+			}
+			ioq_room(0, 1);
+			ioq[ioq_len++] = c;
+		}
+		node = map_child(node, ioq[n++]);
+		if (!node || !maps[node].count)
+			break;
+		if (maps[node].rhs) {
+			m = &maps[node];
+			len = n;
+			if (m->count == 1)
+				break;	// nothing longer to wait for
+		}
+	}
+	if (!m)
+		return 0;
+	n = strlen(m->rhs);
+	// a rhs starting with its lhs doesn't map it again
+	ioq_nore = m->nore ? n : (n >= len && memcmp(m->rhs, ioq, len) == 0) ? len : 0;
+	ioq += len;
+	ioq_len -= len;
+	ioq_push(m->rhs, n);
+#  if ENABLE_FEATURE_VI_MACRO
+	// the rhs replaced keys of a @, and maybe some typed after it
+	if (ioq_macro)
+		ioq_macro = MAX(ioq_macro - len, n);
+#  endif
+	return 1;
+}
+# endif
+
+// Take n keys off the head of the queue
+static void ioq_skip(int n)
+{
+	ioq += n;
+	ioq_len -= n;
+	ioq_dot = MAX(ioq_dot - n, 0);
+	IF_FEATURE_VI_MAP(ioq_nore = MAX(ioq_nore - n, 0);)
+	IF_FEATURE_VI_MACRO(ioq_macro = MAX(ioq_macro - n, 0);)
+}
+
 static int get_one_char(void)
 {
 	int c;
+	char ch;
 
-	if (!adding2q) {
-		// we are not adding to the q.
-		// but, we may be reading from a saved q.
-		// (checking "ioq" for NULL is wrong, it's not reset to NULL
-		// when done - "ioq_start" is reset instead).
-		if (ioq_start != NULL) {
-			// there is a queue to get chars from.
-			// careful with correct sign expansion!
-			c = (unsigned char)*ioq++;
-			if (c != '\0')
-				return c;
-			// the end of the q
-			free(ioq_start);
-			ioq_start = NULL;
-			// read from STDIN:
-		}
-		return readit();
-	}
-	// we are adding STDIN chars to q.
-	c = readit();
-	if (lmc_len >= ARRAY_SIZE(last_modifying_cmd) - 2) {
-		// last_modifying_cmd[] is too small, can't remember the cmd
-		// - drop it
-		adding2q = 0;
-		lmc_len = 0;
-	} else {
-		last_modifying_cmd[lmc_len++] = c;
+# if ENABLE_FEATURE_VI_MAP
+	for (c = 0; map_expand(); c++) {
+		if (c == 1000) {
+			status_line_bold("Recursive mapping");
+			ioq_flush();
+			break;
+		}
+	}
+# endif
+	if (ioq_len && interrupted()) {
+		// ^C stops a '.', @ or mapping
+		ioq_flush();
+	}
+	dot_replay = (ioq_dot != 0);
+	if (ioq_len) {
+		// careful with correct sign expansion!
+		c = (unsigned char)*ioq;
+		ioq_skip(1);
+	}
+# if ENABLE_FEATURE_VI_MAP
+	else if (pending_key) {
+		c = pending_key;
+		pending_key = 0;
+	}
+# endif
+	else {
+		c = readit();
+	}
+	if (!adding2q)
+		return c;
+	// we are adding the keys to q
+#if ENABLE_FEATURE_VI_PASTE
+	if (c == KEYCODE_PASTE) {
+		// '.' is to insert the text again
+		if (!memchr(paste_buf, '\0', paste_len)) {
+			keys_add(&last_modifying_cmd, &lmc_len, &lmc_size,
+					paste_buf, paste_len);
+		} else {
+			adding2q = 0;
+			lmc_len = 0;
+		}
+		return c;
 	}
+#endif
+	ch = c;
+	keys_add(&last_modifying_cmd, &lmc_len, &lmc_size, &ch, 1);
 	return c;
 }
 #else
 # define get_one_char() readit()
 #endif
 
+// A key a command takes as it is, as with f x, r x, "x or ^V x,
+// which :map doesn't apply to
+static int get_arg_char(void)
+{
+#if ENABLE_FEATURE_VI_MAP
+	int c;
+
+	no_mapping++;
+	c = get_one_char();
+	no_mapping--;
+	return c;
+#else
+	return get_one_char();
+#endif
+}
+
+// is there a key get_one_char() would return at once?
+static int key_waiting(void)
+{
+	return readbuffer[0]
+		IF_FEATURE_VI_DOT_CMD(|| ioq_len) // keys of a '.' or :map
+		IF_FEATURE_VI_MAP(|| pending_key)
+		|| mysleep(0);
+}
+
 // Get type of thing to operate on and adjust count
 static int get_motion_char(void)
 {
@@ -1018,31 +2522,69 @@ static char *get_input_line(const char *prompt)
 
 	int c;
 	int i;
+	// keys a @ replays aren't shown
+	int quiet = IF_FEATURE_VI_MACRO(ioq_macro != 0 ||) 0;
+#if ENABLE_FEATURE_VI_SETOPTS && ENABLE_FEATURE_VI_SEARCH
+	int inc = !quiet && inc_begin(prompt);
+#endif
 
 	strcpy(buf, prompt);
 	last_status_cksum = 0;	// force status update
-	go_bottom_and_clear_to_eol();
-	write1(buf);      // write out the :, /, or ? prompt
+	if (!quiet) {
+		go_bottom_and_clear_to_eol();
+		write1(buf);      // write out the :, /, or ? prompt
+	}
 
 	i = strlen(buf);
+	IF_FEATURE_VI_MAP(map_input = 1;)	// :map! applies
 	while (i < MAX_INPUT_LEN - 1) {
+#if ENABLE_FEATURE_VI_SETOPTS && ENABLE_FEATURE_VI_SEARCH
+		if (inc)
+			inc_typed(buf);
+#endif
 		c = get_one_char();
+		if (c == 27 && interrupt_key()) {
+			// ^C: the line is not to be done
+			buf[0] = '\0';
+			break;
+		}
 		if (c == '\n' || c == '\r' || c == 27)
 			break;		// this is end of input
 		if (isbackspace(c)) {
 			// user wants to erase prev char
 			buf[--i] = '\0';
-			go_bottom_and_clear_to_eol();
+			if (!quiet)
+				go_bottom_and_clear_to_eol();
 			if (i <= 0) // user backs up before b-o-l, exit
 				break;
-			write1(buf);
+			if (!quiet)
+				write1(buf);
 		} else if (c > 0 && c < 256) { // exclude Unicode
 			// (TODO: need to handle Unicode)
 			buf[i] = c;
 			buf[++i] = '\0';
-			bb_putchar(c);
+			if (!quiet)
+				bb_putchar(c);
+		}
+#if ENABLE_FEATURE_VI_PASTE
+		else if (c == KEYCODE_PASTE) {
+			// its first line, as much as fits
+			int n = strchrnul(paste_buf, '\n') - paste_buf;
+
+			n = MIN(n, MAX_INPUT_LEN - 1 - i);
+			memcpy(buf + i, paste_buf, n);
+			buf[i + n] = '\0';
+			if (!quiet)
+				write1(buf + i);
+			i += n;
 		}
+#endif
 	}
+	IF_FEATURE_VI_MAP(map_input = 0;)
+#if ENABLE_FEATURE_VI_SETOPTS && ENABLE_FEATURE_VI_SEARCH
+	if (inc)
+		inc_end();
+#endif
 	refresh(FALSE);
 	return buf;
 #undef buf
@@ -1075,10 +2617,8 @@ static int format_edit_status(void)
 	// (this will cause a mis-reporting of modified status
 	// once every MAXINT editing operations.)
 
-	// it would be nice to do a similar optimization here -- if
-	// we haven't done a motion that could have changed which line
-	// we're on, then we shouldn't have to do this count_lines()
-	cur = count_lines(text, dot);
+	// line_number() only walks from where it was last asked
+	cur = line_number(dot);
 
 	// count_lines() is expensive.
 	// Call it only if something was changed since last time
@@ -1114,6 +2654,11 @@ static int format_edit_status(void)
 #endif
 		(modified_count ? " [Modified]" : ""),
 		cur, tot, percent);
+#if ENABLE_FEATURE_VI_MACRO
+	if (recording && ret >= 0 && ret < trunc_at)
+		ret += snprintf(status_buffer + ret, trunc_at + 1 - ret,
+				" recording @%c", recording);
+#endif
 
 	if (ret >= 0 && ret < trunc_at)
 		return ret;  // it all fit
@@ -1131,10 +2676,37 @@ static int bufsum(char *buf, int count)
 	return sum;
 }
 
+#if ENABLE_FEATURE_VI_SETOPTS
+// rewrite only the part of the status line which differs from
+// what is on the terminal
+static void update_status_line(int cnt)
+{
+	int old = strlen(status_shown);
+	int i, j;
+
+	for (i = 0; i < cnt && i < old; i++)
+		if (status_buffer[i] != status_shown[i])
+			break;
+	j = cnt;
+	if (cnt == old) {
+		while (j > i && status_buffer[j - 1] == status_shown[j - 1])
+			j--;
+	}
+	place_cursor(rows - 1, i);
+	fwrite(status_buffer + i, j - i, 1, stdout);
+	if (cnt < old)
+		clear_to_eol();
+}
+#endif
+
 static void show_status_line(void)
 {
 	int cnt = 0, cksum = 0;
 
+#if ENABLE_FEATURE_VI_MACRO
+	if (ioq_macro)
+		return;		// see refresh()
+#endif
 	// either we already have an error or status message, or we
 	// create one.
 	if (!have_status_msg) {
@@ -1142,15 +2714,29 @@ static void show_status_line(void)
 		cksum = bufsum(status_buffer, cnt);
 	}
 	if (have_status_msg || ((cnt > 0 && last_status_cksum != cksum))) {
-		last_status_cksum = cksum;		// remember if we have seen this line
-		go_bottom_and_clear_to_eol();
-		if (have_status_msg > 1) {
-			standout_start();
-			write1(status_buffer);
-			standout_end();
-		} else {
-			write1(status_buffer);
+#if ENABLE_FEATURE_VI_SETOPTS
+		// status_shown is valid unless the status line was disturbed
+		if (slowopen && !have_status_msg && last_status_cksum) {
+			update_status_line(cnt);
+		} else
+#endif
+		{
+			go_bottom_and_clear_to_eol();
+			if (have_status_msg > 1) {
+				standout_start();
+				write1(status_buffer);
+				standout_end();
+			} else {
+				write1(status_buffer);
+			}
+		}
+#if ENABLE_FEATURE_VI_SETOPTS
+		if (!have_status_msg) {
+			memcpy(status_shown, status_buffer, cnt);
+			status_shown[cnt] = '\0';
 		}
+#endif
+		last_status_cksum = cksum;		// remember if we have seen this line
 		if (have_status_msg) {
 			if (((int)strlen(status_buffer)) > (columns - 1) ) {
 				have_status_msg = 0;
@@ -1309,6 +2895,7 @@ static uintptr_t text_hole_make(char *p, int size)	// at "p", make a 'size' byte
 
 	if (size <= 0)
 		return bias;
+	text_changing(p, size);
 	end += size;		// adjust the new END
 	if (end >= (text + text_size)) {
 		char *new_text;
@@ -1377,6 +2964,7 @@ static char *text_hole_delete(char *p, char *q, int undo)
 	if (dest < text || dest >= end)
 		goto thd0;
 	modified_count++;
+	text_changing(dest, -hole_size);
 	if (src >= end)
 		goto thd_atend;	// just delete the end of the buffer
 	memmove(dest, src, cnt);
@@ -1620,14 +3208,14 @@ static void dot_left(void)
 {
 	undo_queue_commit();
 	if (dot > text && dot[-1] != '\n')
-		dot--;
+		dot = char_start(dot - 1);
 }
 
 static void dot_right(void)
 {
 	undo_queue_commit();
 	if (dot < end - 1 && *dot != '\n')
-		dot++;
+		dot += char_len(dot);
 }
 
 static void dot_begin(void)
@@ -1651,7 +3239,7 @@ static char *move_to_col(char *p, int l)
 	do {
 		if (*p == '\n') //vda || *p == '\0')
 			break;
-		co = next_column(*p, co);
+		co = next_column(p, co);
 	} while (co <= l && p++ < end);
 	return p;
 }
@@ -1691,7 +3279,7 @@ static void dot_to_char(int cmd)
 				return;
 			}
 		} while (*q != last_search_char);
-	} while (--cmdcnt > 0);
+	} while (--cmdcnt > 0 && !interrupted());
 
 	dot = q;
 
@@ -1743,10 +3331,10 @@ static char *bound_dot(char *p) // make sure  text[0] <= P < "end"
 #if ENABLE_FEATURE_VI_DOT_CMD
 static void start_new_cmd_q(char c)
 {
-	// get buffer for new cmd
+	// reuse the buffer of the last cmd
 	dotcnt = cmdcnt ?: 1;
-	last_modifying_cmd[0] = c;
-	lmc_len = 1;
+	lmc_len = 0;
+	keys_add(&last_modifying_cmd, &lmc_len, &lmc_size, &c, 1);
 	adding2q = 1;
 }
 static void end_cmd_q(void)
@@ -1788,6 +3376,25 @@ static char *yank_delete(char *start, char *stop, int buftype, int yf, int undo)
 	return p;
 }
 
+// full_read() or full_write() of a big file, a piece at a time so
+// that ^C can stop it. Returns how much was done, -1 if nothing could be
+static int file_io(int fd, char *p, int size, int wr)
+{
+	int done = 0;
+
+	while (done < size && !interrupted()) {
+		int want = MIN(size - done, 1 << 20);
+		int n = wr ? full_write(fd, p + done, want) : full_read(fd, p + done, want);
+
+		if (n < 0)
+			return done ?: -1;
+		done += n;
+		if (n < want)
+			break;
+	}
+	return done;
+}
+
 // might reallocate text[]!
 static int file_insert(const char *fn, char *p, int initial)
 {
@@ -1818,14 +3425,22 @@ static int file_insert(const char *fn, char *p, int initial)
 	}
 	size = (statbuf.st_size < INT_MAX ? (int)statbuf.st_size : INT_MAX);
 	p += text_hole_make(p, size);
-	cnt = full_read(fd, p, size);
+	cnt = file_io(fd, p, size, 0);
 	if (cnt < 0) {
 		status_line_bold_errno(fn);
 		p = text_hole_delete(p, p + size - 1, NO_UNDO);	// un-do buffer insert
 	} else if (cnt < size) {
 		// There was a partial read, shrink unused space
 		p = text_hole_delete(p + cnt, p + size - 1, NO_UNDO);
-		status_line_bold("can't read '%s'", fn);
+		if (interrupted()) {
+			// ^C: what was read is kept
+			status_line_bold("Interrupted, %u of %u bytes read", cnt, size);
+# if ENABLE_FEATURE_VI_UNDO
+			undo_push_insert(p, cnt, ALLOW_UNDO);
+# endif
+		} else {
+			status_line_bold("can't read '%s'", fn);
+		}
 	}
 # if ENABLE_FEATURE_VI_UNDO
 	else {
@@ -1882,21 +3497,42 @@ static char *find_pair(char *p, const char c)
 // show the matching char of a pair,  ()  []  {}
 static void showmatching(char *p)
 {
-	char *q, *save_dot;
+	char *q;
 
 	// we found half of a pair
 	q = find_pair(p, *p);	// get loc of matching char
 	if (q == NULL) {
 		indicate_error();	// no matching char
 	} else {
-		// "q" now points to matching pair
-		save_dot = dot;	// remember where we are
-		dot = q;		// go to new loc
-		refresh(FALSE);	// let the user see it
-		mysleep(40);	// give user some time
-		dot = save_dot;	// go back to old loc
-		refresh(FALSE);
+		// "q" now points to matching pair, the main loop
+		// shows it once the screen is up to date
+		showmatch_ofs = q - text;
+	}
+}
+
+static void showmatch_end(void)
+{
+	place_cursor(crow, ccol);	// back to "dot"
+}
+
+// put the cursor on the matching bracket for a while, if it is
+// on screen
+static void show_pending_match(void)
+{
+	char *q = text + showmatch_ofs;
+	char *sb = screenbegin;
+	int ofs = offset;
+	int ro, co;
+
+	if (q >= end || !strchr("([{", *q))
+		return;	// text changed since
+	sync_cursor(q, &ro, &co);
+	if (screenbegin == sb && offset == ofs) {
+		place_cursor(ro, co);
+		start_timed(showmatch_end, 400);
 	}
+	screenbegin = sb;
+	offset = ofs;
 }
 #endif /* FEATURE_VI_SETOPTS */
 
@@ -1936,7 +3572,8 @@ static char *char_insert(char *p, char c, int undo) // insert the char c at 'p'
 	if (c == 22) {		// Is this an ctrl-V?
 		p += stupid_insert(p, '^');	// use ^ to indicate literal next
 		refresh(FALSE);	// show the ^
-		c = get_one_char();
+		c = get_arg_char();
+		text_changing(p, 0);
 		*p = c;
 #if ENABLE_FEATURE_VI_UNDO
 		undo_push_insert(p, 1, undo);
@@ -2004,8 +3641,12 @@ static char *char_insert(char *p, char c, int undo) // insert the char c at 'p'
 #endif
 			}
 		} else if (p > text) {
-			p--;
-			p = text_hole_delete(p, p, ALLOW_UNDO_QUEUED);	// shrink buffer 1 char
+			char *q = char_start(p - 1);
+			// a byte at a time, the undo queue takes single chars
+			while (p > q) {
+				p--;
+				p = text_hole_delete(p, p, ALLOW_UNDO_QUEUED);	// shrink buffer 1 char
+			}
 		}
 	} else {
 		// insert a char into text[]
@@ -2035,6 +3676,7 @@ static char *char_insert(char *p, char c, int undo) // insert the char c at 'p'
 				if (len && col == indentcol) {
 					// previous line was empty except for autoindent
 					// move the indent to the current line
+					text_changing(bol, 0);
 					memmove(bol + 1, bol, len);
 					*bol = '\n';
 					return p;
@@ -2077,6 +3719,45 @@ static char *char_insert(char *p, char c, int undo) // insert the char c at 'p'
 	return p;
 }
 
+#if ENABLE_FEATURE_VI_DOT_CMD
+// Keys char_insert() does nothing special with
+# define dot_plain(c) ((unsigned char)(c) >= ' ' && (unsigned char)(c) != 0x7f \
+			&& !isbackspace((unsigned char)(c)))
+
+// While '.' repeats an insert, c and the plain keys queued after it
+// go in with one hole in text[], not one per key
+static char *dot_insert(char *p, int c)
+{
+	int n = 0;
+# if ENABLE_FEATURE_VI_UNDO
+	int undo = ALLOW_UNDO_QUEUED;
+# endif
+
+	while (n < ioq_dot && dot_plain(ioq[n]))
+		n++;
+# if ENABLE_FEATURE_VI_UNDO
+#  if ENABLE_FEATURE_VI_UNDO_QUEUE
+	if (undo_q + n + 1 >= CONFIG_FEATURE_VI_UNDO_QUEUE_MAX) {
+		// more than the queue takes
+		undo_queue_commit();
+		undo = ALLOW_UNDO;
+	}
+#  endif
+	undo_push_insert(p, n + 1, undo);
+# else
+	modified_count++;
+# endif
+	p += text_hole_make(p, n + 1);
+	*p++ = c;
+	memcpy(p, ioq, n);
+	ioq_skip(n);
+# if ENABLE_FEATURE_VI_SETOPTS
+	char_insert__indentcol = 0;
+# endif
+	return p + n;
+}
+#endif
+
 #if ENABLE_FEATURE_VI_COLON_EXPAND
 static void init_filename(char *fn)
 {
@@ -2122,6 +3803,9 @@ static int init_text_buffer(char *fn)
 	free(text);
 	text_size = 10240;
 	screenbegin = dot = end = text = xzalloc(text_size);
+	lnum_ofs = lnum_cnt = lnum_hole_len = 0;
+	row_valid = 0;
+	hl_flush();
 
 	update_filename(fn);
 	rc = file_insert(fn, text, 1);
@@ -2130,6 +3814,7 @@ static int init_text_buffer(char *fn)
 		// insert a newline to the end
 		char_insert(end, '\n', NO_UNDO);
 	}
+	syn_select();
 
 	flush_undo_data();
 	modified_count = 0;
@@ -2154,14 +3839,61 @@ static uintptr_t string_insert(char *p, const char *s, int undo) // insert the s
 	uintptr_t bias;
 	int i;
 
-	i = strlen(s);
+	i = strlen(s);
+#if ENABLE_FEATURE_VI_UNDO
+	undo_push_insert(p, i, undo);
+#endif
+	bias = text_hole_make(p, i);
+	p += bias;
+	memcpy(p, s, i);
+	return bias;
+}
+#endif
+
+#if ENABLE_FEATURE_VI_PASTE
+// Insert the pasted text at 'p' as it is: one hole, one undo
+// record and no autoindent. In command mode the cursor goes to
+// its last char, else after it. In R mode it takes the place of
+// as many chars as it has, but for NLs, up to the end of the line.
+static char *paste_insert(char *p)
+{
+#if ENABLE_FEATURE_VI_UNDO
+	int undo = ALLOW_UNDO;
+#endif
+
+	if (paste_len == 0)
+		return p;
+#if ENABLE_FEATURE_VI_UNDO
+	undo_queue_commit();
+#endif
+	if (cmd_mode == 2) {
+		const char *s;
+		char *q = p;
+
+		for (s = paste_buf; s < paste_buf + paste_len && *q != '\n'; s++) {
+# if ENABLE_FEATURE_VI_UTF8
+			if (utf8 && (*s & 0xc0) == 0x80)
+				continue;	// inside a char
+# endif
+			if (*s != '\n')
+				q += char_len(q);
+		}
+		if (q > p) {
+			p = text_hole_delete(p, q - 1, ALLOW_UNDO);
+			IF_FEATURE_VI_UNDO(undo = ALLOW_UNDO_CHAIN;)
+		}
+	}
 #if ENABLE_FEATURE_VI_UNDO
-	undo_push_insert(p, i, undo);
+	undo_push_insert(p, paste_len, undo);
+#else
+	modified_count++;
 #endif
-	bias = text_hole_make(p, i);
-	p += bias;
-	memcpy(p, s, i);
-	return bias;
+	p += text_hole_make(p, paste_len);
+	memcpy(p, paste_buf, paste_len);
+	p += paste_len;
+	if (cmd_mode == 0)
+		p = char_start(p - 1);
+	return p;
 }
 #endif
 
@@ -2180,11 +3912,14 @@ static int file_write(char *fn, char *first, char *last)
 	if (fd < 0)
 		return -1;
 	cnt = last - first + 1;
-	charcnt = full_write(fd, first, cnt);
+	charcnt = file_io(fd, first, cnt, 1);
 	ftruncate(fd, charcnt);
 	if (charcnt == cnt) {
 		// good write
 		//modified_count = FALSE;
+	} else if (interrupted()) {
+		status_line_bold("Interrupted, '%s' is cut short", fn);
+		charcnt = -2;
 	} else {
 		charcnt = 0;
 	}
@@ -2193,102 +3928,488 @@ static int file_write(char *fn, char *first, char *last)
 }
 
 #if ENABLE_FEATURE_VI_SEARCH
+# if ENABLE_FEATURE_VI_SETOPTS
+// what pat_kind() says of a pattern
+enum {
+	PAT_PLAIN = 1 << 0,	// it matches only itself
+	PAT_LINES = 1 << 1,	// no match of it spans a newline
+	PAT_BAD = 1 << 2,	// it does not compile
+};
+# endif
+
+// par_search() over text[], which ^C stops
+static char *search_pieces(par_fn *fn, void *arg, char *lo, char *hi, int flags)
+{
+	char *q;
+# if ENABLE_FEATURE_VI_READER_THREAD
+	q = par_search(fn, interrupted, arg, lo, hi, flags);
+	if (!q && interrupted())
+		status_line_bold("Interrupted");
+# elif ENABLE_FEATURE_VI_SEARCH_THREADS && ENABLE_FEATURE_VI_USE_SIGNALS
+	sigset_t intr, old;
+
+	// int_handler() would jump out with other threads still on
+	// the search: ^C waits for it to end
+	sigemptyset(&intr);
+	sigaddset(&intr, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &intr, &old);
+	q = par_search(fn, NULL, arg, lo, hi, flags);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+# else
+	q = par_search(fn, NULL, arg, lo, hi, flags);
+# endif
+	return q;
+}
 # if ENABLE_FEATURE_VI_REGEX_SEARCH
+// pat compiled for the current ignorecase. 'n', :s, hlsearch and
+// ex addresses ask for the same few patterns over and over
+static struct regex *get_regex(const char *pat, const char **err)
+{
+	struct rx_entry e;
+	int i, last = ARRAY_SIZE(rx_cache) - 1;
+
+	for (i = 0; i < last; i++) {
+		if (rx_cache[i].pat && strcmp(rx_cache[i].pat, pat) == 0
+		 && rx_cache[i].icase == ignorecase
+		) {
+			break;
+		}
+	}
+	e = rx_cache[i];
+	if (!e.pat || strcmp(e.pat, pat) != 0 || e.icase != ignorecase) {
+		// not there, the least recently used one goes
+		free(e.pat);
+		rx_free(e.re);
+		e.pat = xstrdup(pat);
+		e.icase = ignorecase;
+		e.re = rx_compile(pat, ignorecase ? RX_ICASE : 0, &e.err);
+	}
+	memmove(rx_cache + 1, rx_cache, i * sizeof(rx_cache[0]));
+	rx_cache[0] = e;
+	*err = e.err;
+	return e.re;
+}
+
+// what the threads of one search share
+struct search_job {
+	int dir;
+	struct regex *re;
+	struct regex **clone;	// of re, for each other thread
+};
+
+// search a piece of text[], on a thread of par_search()
+static char *search_piece(void *arg, int w, const char *s, const char *e)
+{
+	struct search_job *j = arg;
+	struct regex *re = j->re;
+	int flags = (s > text ? RX_TEXT_BEFORE : 0) | RX_TEXT_AFTER;
+
+	if (w) {
+		if (!j->clone[w])
+			j->clone[w] = rx_clone(re);
+		re = j->clone[w];
+	}
+	if (j->dir > 0)
+		return rx_search(re, s, e, flags, NULL, 0);
+	return rx_search_back(re, s, e, flags, NULL, 0);
+}
+
+// the match in lo..hi-1 nearest to lo (FORWARD) or hi (BACK)
+static char *search_range(struct regex *re, char *lo, char *hi, int dir)
+{
+	struct search_job j;
+	char *q;
+	int i, n;
+
+	// 'n' looks from dot + dir, which can be past either end
+	if (lo > hi)
+		return NULL;
+	j.dir = dir;
+	j.re = re;
+	// pieces are whole lines, which a match can't run past
+	if (!rx_in_lines(re))
+		return search_piece(&j, 0, lo, hi);
+	n = par_threads();
+	j.clone = xzalloc(n * sizeof(j.clone[0]));
+	q = search_pieces(search_piece, &j, lo, hi, PAR_LINES | (dir < 0 ? PAR_BACK : 0));
+	for (i = 1; i < n; i++)
+		rx_free(j.clone[i]);
+	free(j.clone);
+	return q;
+}
+
 // search for pattern starting at p
 static char *char_search(char *p, const char *pat, int dir_and_range)
 {
-	struct re_pattern_buffer preg;
+	struct regex *re;
 	const char *err;
 	char *q;
-	int i, size, range, start;
-
-	re_syntax_options = RE_SYNTAX_POSIX_BASIC & (~RE_DOT_NEWLINE);
-	if (ignorecase)
-		re_syntax_options |= RE_ICASE;
+	int range;
 
-	memset(&preg, 0, sizeof(preg));
-	err = re_compile_pattern(pat, strlen(pat), &preg);
-	preg.not_bol = p != text;
-	preg.not_eol = p != end - 1;
-	if (err != NULL) {
+	re = get_regex(pat, &err);
+	if (!re) {
 		status_line_bold("bad search pattern '%s': %s", pat, err);
 		return p;
 	}
 
 	range = (dir_and_range & 1);
-	q = end - 1; // if FULL
-	if (range == LIMITED)
-		q = next_line(p);
-	if (dir_and_range < 0) { // BACK?
-		q = text;
+	if (dir_and_range > 0) { //FORWARD?
+		q = end - 1;	// range is p..end-1
 		if (range == LIMITED)
-			q = prev_line(p);
+			q = next_line(p);	// range is to next line
+		return search_range(re, p, q, FORWARD);
 	}
+	//BACK
+	q = text;	// range is text..p
+	if (range == LIMITED)
+		q = prev_line(p);	// range is to prev line
+	return search_range(re, q, p, BACK);
+}
 
-	// RANGE could be negative if we are searching backwards
-	range = q - p;
-	if (range < 0) {
-		size = -range;
-		start = size;
-	} else {
-		size = range;
-		start = 0;
-	}
-	q = p - start;
-	if (q < text)
-		q = text;
-	// search for the compiled pattern, preg, in p[]
-	// range < 0, start == size: search backward
-	// range > 0, start == 0: search forward
-	// re_search() < 0: not found or error
-	// re_search() >= 0: index of found pattern
-	//           struct pattern   char     int   int    int    struct reg
-	// re_search(*pattern_buffer, *string, size, start, range, *regs)
-	i = re_search(&preg, q, size, start, range, /*struct re_registers*:*/ NULL);
-	regfree(&preg);
-	return i < 0 ? NULL : q + i;
+// char_search(p, pat, (dir << 1) | FULL) found nothing: where to go
+// on from the other end of text[], only as far as a match could still
+// be. 0 if there is nowhere
+static int wrap_range(char *p, const char *pat, int dir, char **lo, char **hi)
+{
+	struct regex *re;
+	const char *err;
+
+	re = get_regex(pat, &err);
+	if (!re)
+		return 0;
+	if (dir > 0) {
+		// a match which starts before p
+		if (p <= text)
+			return 0;
+		*lo = text;
+		*hi = rx_in_lines(re) ? end_line(p - 1) : end - 1;
+		return 1;
+	}
+	// a match which ends after p
+	p = MAX(p, text);
+	*lo = rx_in_lines(re) ? begin_line(p) : text;
+	*hi = end - 1;
+	return 1;
 }
-# else
+
+static char *search_in(char *lo, char *hi, const char *pat, int dir)
+{
+	struct regex *re;
+	const char *err;
+
+	re = get_regex(pat, &err);
+	if (!re)
+		return NULL;
+	return search_range(re, lo, hi, dir);
+}
+
 #  if ENABLE_FEATURE_VI_SETOPTS
-static int mycmp(const char *s1, const char *s2, int len)
+static int pat_kind(const char *pat)
 {
-	if (ignorecase) {
-		return strncasecmp(s1, s2, len);
-	}
-	return strncmp(s1, s2, len);
+	struct regex *re;
+	const char *err;
+
+	re = get_regex(pat, &err);
+	if (!re)
+		return PAT_BAD;
+	return (rx_in_lines(re) ? PAT_LINES : 0)
+		| (strpbrk(pat, "\\.*[^$") ? 0 : PAT_PLAIN);
+}
+#  endif
+
+#  if ENABLE_FEATURE_VI_SETOPTS
+// find hlsearch pattern in p..stop-1, which is on one line
+static char *hl_match(char *p, char *stop, int *len)
+{
+	const char *sub[2];
+
+	if (!hl_re)
+		return NULL;
+	p = rx_search(hl_re, p, stop, (p > text ? RX_TEXT_BEFORE : 0) | RX_TEXT_AFTER, sub, 1);
+	if (p)
+		*len = sub[1] - sub[0];
+	return p;
 }
-#  else
-#   define mycmp strncmp
 #  endif
+# else
+// what the threads of one search share
+struct search_job {
+	int dir;
+	const char *limit;	// a match can't run past
+};
+
+// search a piece of text[], on a thread of par_search(): for a match
+// which starts in s..e-1
+static char *search_piece(void *arg, int w UNUSED_PARAM, const char *s, const char *e)
+{
+	struct search_job *j = arg;
+	const char *stop = MIN(e - 1 + search_ss.len, j->limit);
+
+	if (j->dir > 0)
+		return strsearch_fwd(&search_ss, s, stop);
+	return strsearch_back(&search_ss, s, stop);
+}
+
+// the match nearest to lo which starts in lo..hi-1 (FORWARD), or
+// the one nearest to hi in lo..hi-1 (BACK)
+static char *search_range(char *lo, char *hi, int dir)
+{
+	struct search_job j;
+
+	if (lo >= hi)
+		return NULL;
+	j.dir = dir;
+	j.limit = dir > 0 ? end : hi;
+	return search_pieces(search_piece, &j, lo, hi, dir < 0 ? PAR_BACK : 0);
+}
+
+static void search_prepare(const char *pat)
+{
+	// 'n' and ':s' search for the same pattern over and over
+	if (!search_ss.pat || strcmp(search_ss.pat, pat) != 0
+	 || search_ss.icase != ignorecase
+	) {
+		strsearch_init(&search_ss, pat, ignorecase);
+	}
+}
+
 static char *char_search(char *p, const char *pat, int dir_and_range)
 {
-	char *start, *stop;
-	int len;
+	char *stop;
 	int range;
 
-	len = strlen(pat);
+	search_prepare(pat);
 	range = (dir_and_range & 1);
 	if (dir_and_range > 0) { //FORWARD?
 		stop = end - 1;	// assume range is p..end-1
 		if (range == LIMITED)
 			stop = next_line(p);	// range is to next line
-		for (start = p; start < stop; start++) {
-			if (mycmp(start, pat, len) == 0) {
-				return start;
-			}
+		// a match starts before stop
+		return search_range(p, stop, FORWARD);
+	}
+	//BACK
+	stop = text;	// assume range is text..p
+	if (range == LIMITED)
+		stop = prev_line(p);	// range is to prev line
+	return search_range(stop, p, BACK);
+}
+
+// char_search(p, pat, (dir << 1) | FULL) found nothing: where to go
+// on from the other end of text[], only as far as a match could still be
+static int wrap_range(char *p, const char *pat, int dir, char **lo, char **hi)
+{
+	if (dir > 0) {	// a match which starts before p
+		*lo = text;
+		*hi = p;
+	} else {	// a match which ends after p
+		*lo = MAX(p - (int)strlen(pat) + 1, text);
+		*hi = end - 1;
+	}
+	return 1;
+}
+
+static char *search_in(char *lo, char *hi, const char *pat, int dir)
+{
+	search_prepare(pat);
+	return search_range(lo, hi, dir);
+}
+
+#  if ENABLE_FEATURE_VI_SETOPTS
+static int pat_kind(const char *pat)
+{
+	return PAT_PLAIN | (strchr(pat, '\n') ? 0 : PAT_LINES);
+}
+#  endif
+
+#  if ENABLE_FEATURE_VI_SETOPTS
+// find hlsearch pattern in p..stop-1
+static char *hl_match(char *p, char *stop, int *len)
+{
+	*len = hl_ss.len;
+	return strsearch_fwd(&hl_ss, p, stop);
+}
+#  endif
+# endif
+
+// char_search(p, pat, (dir << 1) | FULL) found nothing: go on from
+// the other end of text[]
+static char *char_search_wrap(char *p, const char *pat, int dir)
+{
+	char *lo, *hi;
+
+	if (!wrap_range(p, pat, dir, &lo, &hi))
+		return NULL;
+	return search_in(lo, hi, pat, dir);
+}
+
+# if ENABLE_FEATURE_VI_SETOPTS
+//----- incsearch ---------------------------------------------
+// The pattern being typed is looked for a slice of text[] at a time,
+// between keys, so that typing never waits for a search. When a
+// plain pattern is only made longer, no match of it can be where the
+// shorter one had none: the search goes on from where that one was.
+enum {
+	INC_SLICE = 256 * 1024,	// bytes looked through in one go
+	INC_BUDGET = 20,	// ms to look for, before the key is shown
+};
+
+// make ready to go to the matches of the pattern typed after prompt
+static int inc_begin(const char *prompt)
+{
+	if (!incsearch || (prompt[0] != '/' && prompt[0] != '?') || prompt[1])
+		return 0;
+	free(inc_pat);
+	inc_pat = NULL;
+	inc_dot = dot;
+	inc_top = screenbegin;
+	inc_offset = offset;
+	inc_dir = prompt[0] == '/' ? FORWARD : BACK;
+	inc_from = dot + inc_dir;
+	return 1;
+}
+
+static void inc_start(const char *pat)
+{
+	int kind = pat_kind(pat);
+
+	if (inc_pat && (kind & inc_kind & PAT_PLAIN)
+	 && strncmp(pat, inc_pat, strlen(inc_pat)) == 0
+	) {
+		// inc_at and inc_leg hold, and if inc_pat is nowhere,
+		// so is pat
+		if (inc_found) {
+			inc_found = NULL;
+			inc_done = 0;
 		}
-	} else { //BACK
-		stop = text;	// assume range is text..p
-		if (range == LIMITED)
-			stop = prev_line(p);	// range is to prev line
-		for (start = p - len; start >= stop; start--) {
-			if (mycmp(start, pat, len) == 0) {
-				return start;
-			}
+	} else {
+		inc_leg = 0;
+		inc_at = inc_from;
+		inc_found = NULL;
+		inc_done = (kind == PAT_BAD);
+	}
+	free(inc_pat);
+	inc_pat = xstrdup(pat);
+	inc_kind = kind;
+}
+
+// look for inc_pat in the next slice of about size bytes, whole lines
+static void inc_step(int size)
+{
+	char *lo, *hi, *s, *e, *q;
+
+	if (inc_leg == 0) {
+		lo = inc_dir > 0 ? inc_from : text;
+		hi = inc_dir > 0 ? end - 1 : inc_from;
+	} else if (!wrap_range(inc_from, inc_pat, inc_dir, &lo, &hi)) {
+		inc_done = 1;
+		return;
+	}
+	if (!(inc_kind & PAT_LINES))
+		size = INT_MAX;	// a match could run past any line
+	if (inc_dir > 0) {
+		s = MAX(inc_at, lo);
+		e = hi;
+		if (hi - s > size) {
+			e = memchr(s + size, '\n', hi - s - size);
+			e = e ? e + 1 : hi;
 		}
+		q = search_in(s, e, inc_pat, FORWARD);
+	} else {
+		s = lo;
+		e = MIN(inc_at, hi);
+		if (e - lo > size) {
+			s = memrchr(lo, '\n', e - size - lo);
+			s = s ? s + 1 : lo;
+		}
+		q = search_in(s, e, inc_pat, BACK);
+	}
+	if (q) {
+		inc_found = q;
+		inc_done = 1;
+		return;
+	}
+	if (interrupted())
+		return;	// the slice is to be looked at again
+	inc_at = inc_dir > 0 ? e : s;
+	if (s >= e || (inc_dir > 0 ? e >= hi : s <= lo)) {
+		// the leg is looked through
+		inc_at = inc_dir > 0 ? text : end;
+		inc_done = inc_leg++;
+	}
+}
+
+static void inc_run(void)
+{
+	unsigned long long t = monotonic_ms() + INC_BUDGET;
+
+	do
+		inc_step(INC_SLICE);
+	while (!inc_done && monotonic_ms() < t);
+}
+
+// the match so far, or where the search started, under the prompt
+static void inc_show(const char *buf)
+{
+	dot = inc_found ?: inc_dot;
+	refresh(FALSE);
+	go_bottom_and_clear_to_eol();
+	write1(buf);
+}
+
+// get_input_line() is to read a key, buf is what it has so far
+static void inc_typed(const char *buf)
+{
+	const char *pat = buf + 1;
+
+	if (inc_pat ? strcmp(pat, inc_pat) != 0 : *pat) {
+		if (*pat) {
+			inc_start(pat);
+			inc_run();
+		} else {
+			free(inc_pat);
+			inc_pat = NULL;
+		}
+		inc_show(buf);
+	}
+	// go on looking until it is found or a key is typed
+	fflush_all();
+	while (inc_pat && !inc_done && !key_waiting()) {
+		inc_run();
+		if (inc_done)
+			inc_show(buf);
 	}
-	// pattern not found
-	return NULL;
+}
+
+// the input is over: back to where it started, the search is
+// for the '/' or '?' to do
+static void inc_end(void)
+{
+	dot = inc_dot;
+	screenbegin = inc_top;
+	offset = inc_offset;
+}
+
+// The search for pat from 'from' which the '/' or '?' just typed asks
+// for: if incsearch has looked for it, *q is the match. Returns the
+// leg it is on (1: wrapped), or -1 if it is to be searched for
+static int inc_known(char *from, int dir, const char *pat, char **q)
+{
+	int leg = -1;
+
+	if (inc_pat && inc_kind != PAT_BAD && inc_from == from
+	 && inc_dir == dir && strcmp(inc_pat, pat) == 0
+	) {
+		// the rest of it in one go
+		while (!inc_done && !interrupted())
+			inc_step(INT_MAX);
+		if (inc_done) {
+			*q = inc_found;
+			leg = inc_found ? inc_leg : 1;
+		}
+	}
+	free(inc_pat);
+	inc_pat = NULL;
+	return leg;
 }
 # endif
 #endif /* FEATURE_VI_SEARCH */
@@ -2304,7 +4425,7 @@ static char *get_one_address(char *p, int *result, int *valid)
 # if ENABLE_FEATURE_VI_YANKMARK || ENABLE_FEATURE_VI_SEARCH
 	char *q, c;
 # endif
-	IF_FEATURE_VI_SEARCH(int dir;)
+	IF_FEATURE_VI_SEARCH(int dir; char *from;)
 
 	got_addr = FALSE;
 	addr = count_lines(text, dot);	// default to current line
@@ -2357,22 +4478,21 @@ static char *get_one_address(char *p, int *result, int *valid)
 			if (*p == c)
 				p++;
 			if (c == '/') {
-				q = next_line(dot);
-				dir = (FORWARD << 1) | FULL;
+				from = next_line(dot);
+				dir = FORWARD;
 			} else {
-				q = begin_line(dot);
-				dir = ((unsigned)BACK << 1) | FULL;
+				from = begin_line(dot);
+				dir = BACK;
 			}
-			q = char_search(q, last_search_pattern + 1, dir);
-			if (q == NULL) {
+			q = char_search(from, last_search_pattern + 1, (dir << 1) | FULL);
+			if (q == NULL && !interrupted()) {
 				// no match, continue from other end of file
-				q = char_search(dir > 0 ? text : end - 1,
-								last_search_pattern + 1, dir);
-				if (q == NULL) {
+				q = char_search_wrap(from, last_search_pattern + 1, dir);
+				if (q == NULL && !interrupted())
 					status_line_bold("Pattern not found");
-					return NULL;
-				}
 			}
+			if (q == NULL)
+				return NULL;
 			addr = count_lines(text, q);
 			got_addr = TRUE;
 		}
@@ -2470,11 +4590,20 @@ static void setops(char *args, int flg_no)
 
 	index = 1 << (index >> 1); // convert to VI_bit
 
-	if (index & VI_TABSTOP) {
+	if (index & (VI_TABSTOP | VI_ESCTIMEOUT | VI_TIMEOUTLEN)) {
 		int t;
 		if (!eq || flg_no) // no "=NNN" or it is "notabstop"?
 			goto bad;
 		t = strtol(eq + 1, NULL, 10);
+		if (index & (VI_ESCTIMEOUT | VI_TIMEOUTLEN)) {
+			if (t < 0 || t > 10000)	// ms
+				goto bad;
+			if (index & VI_ESCTIMEOUT)
+				esc_timeout = t;
+			else
+				timeoutlen = t;
+			return;
+		}
 		if (t <= 0 || t > MAX_TABSTOP)
 			goto bad;
 		tabstop = t;
@@ -2486,6 +4615,79 @@ static void setops(char *args, int flg_no)
 	} else {
 		vi_setops |= index;
 	}
+	if (index & VI_KITTYKEYS)
+		kitty_keys(!flg_no);
+}
+# endif
+
+# if ENABLE_FEATURE_VI_MAP
+// Turn <CR>, <Esc>, <C-x> and such in s into the keys they name
+static void map_keys(char *s)
+{
+	static const char names[] ALIGN1 =
+		"bar\0""bs\0""cr\0""esc\0""lt\0""nl\0""space\0""tab\0";
+	static const char keys[] ALIGN1 = "|\b\r\033<\n \t";
+	char *d = s;
+
+	while (*s) {
+		char *e = (*s == '<') ? strchr(s, '>') : NULL;
+
+		if (e && e - s <= 6) {
+			char name[8];
+			int i, n = e - s - 1;
+
+			for (i = 0; i < n; i++)
+				name[i] = tolower(s[i + 1]);
+			name[n] = '\0';
+			i = index_in_strings(names, name);
+			if (n == 3 && name[0] == 'c' && name[1] == '-' && (s[3] & 0x1f))
+				*d++ = s[3] == '?' ? 0x7f : s[3] & 0x1f;
+			else if (i >= 0)
+				*d++ = keys[i];
+			else
+				goto literal;
+			s = e + 1;
+			continue;
+		}
+ literal:
+		*d++ = *s++;
+	}
+	*d = '\0';
+}
+
+// s with control keys shown as ^X
+static char *map_printable(char *d, const char *s)
+{
+	char *p = d;
+
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if (c < ' ' || c == 0x7f) {
+			*p++ = '^';
+			c ^= 0x40;
+		}
+		*p++ = c;
+	}
+	*p = '\0';
+	return d;
+}
+
+// Show the maps at and below node, lhs[len] is the lhs up to it
+static void map_list(int root, int node, char *lhs, int len)
+{
+	if (maps[node].rhs) {
+		char l[2 * MAX_INPUT_LEN + 1], r[2 * MAX_INPUT_LEN + 1];
+
+		lhs[len] = '\0';
+		printf("%c  %-12s %c %s\r\n", root ? '!' : ' ',
+			map_printable(l, lhs), maps[node].nore ? '*' : ' ',
+			map_printable(r, maps[node].rhs));
+	}
+	for (node = maps[node].child; node; node = maps[node].next) {
+		lhs[len] = maps[node].key;
+		map_list(root, node, lhs, len + 1);
+	}
 }
 # endif
 
@@ -2529,7 +4731,7 @@ static char *expand_args(char *args)
 #endif /* FEATURE_VI_COLON */
 
 #if ENABLE_FEATURE_VI_REGEX_SEARCH
-# define MAX_SUBPATTERN 10	// subpatterns \0 .. \9
+# define MAX_SUBPATTERN RX_MAX_SUB	// subpatterns \0 .. \9
 
 // Like strchr() but skipping backslash-escaped characters
 static char *strchr_backslash(const char *s, int c)
@@ -2546,21 +4748,20 @@ static char *strchr_backslash(const char *s, int c)
 }
 
 // If the return value is not NULL the caller should free R
-static char *regex_search(char *q, regex_t *preg, const char *Rorig,
+static char *regex_search(char *q, struct regex *preg, const char *Rorig,
 				size_t *len_F, size_t *len_R, char **R)
 {
-	regmatch_t regmatch[MAX_SUBPATTERN], *cur_match;
-	char *found = NULL;
+	const char *sub[2 * MAX_SUBPATTERN];
+	char *found;
 	const char *t;
 	char *r;
 
-	regmatch[0].rm_so = 0;
-	regmatch[0].rm_eo = end_line(q) - q;
-	if (regexec(preg, q, MAX_SUBPATTERN, regmatch, REG_STARTEND) != 0)
+	found = rx_search(preg, q, end_line(q), (q > text ? RX_TEXT_BEFORE : 0) | RX_TEXT_AFTER,
+				sub, MAX_SUBPATTERN);
+	if (!found)
 		return found;
 
-	found = q + regmatch[0].rm_so;
-	*len_F = regmatch[0].rm_eo - regmatch[0].rm_so;
+	*len_F = sub[1] - sub[0];
 	*R = NULL;
 
  fill_result:
@@ -2572,10 +4773,10 @@ static char *regex_search(char *q, regex_t *preg, const char *Rorig,
 		if (*t == '\\') {
 			from = ++t;	// skip backslash
 			if (*t >= '0' && *t < '0' + MAX_SUBPATTERN) {
-				cur_match = regmatch + (*t - '0');
-				if (cur_match->rm_so >= 0) {
-					len = cur_match->rm_eo - cur_match->rm_so;
-					from = q + cur_match->rm_so;
+				const char **cur_match = sub + 2 * (*t - '0');
+				if (cur_match[0]) {
+					len = cur_match[1] - cur_match[0];
+					from = cur_match[0];
 				}
 			}
 		}
@@ -2978,17 +5179,35 @@ static void colon(char *buf)
 #  if ENABLE_FEATURE_VI_SETOPTS
 			status_line_bold(
 				"%sautoindent "
+				"esctimeout=%u "
 				"%sexpandtab "
 				"%sflash "
+				"%shlsearch "
 				"%signorecase "
+				"%sincsearch "
+				"%skittykeys "
+				"%snumber "
+				"%srelativenumber "
+				"%sslowopen "
 				"%sshowmatch "
-				"tabstop=%u",
+				"%ssyntax "
+				"tabstop=%u "
+				"timeoutlen=%u",
 				autoindent ? "" : "no",
+				esc_timeout,
 				expandtab ? "" : "no",
 				err_method ? "" : "no",
+				hlsearch ? "" : "no",
 				ignorecase ? "" : "no",
+				incsearch ? "" : "no",
+				kittykeys ? "" : "no",
+				shownumber ? "" : "no",
+				relativenumber ? "" : "no",
+				slowopen ? "" : "no",
 				showmatch ? "" : "no",
-				tabstop
+				syntax ? "" : "no",
+				tabstop,
+				timeoutlen
 			);
 #  endif
 			goto ret;
@@ -3008,6 +5227,52 @@ static void colon(char *buf)
 		}
 #  endif /* FEATURE_VI_SETOPTS */
 # endif /* FEATURE_VI_SET */
+# if ENABLE_FEATURE_VI_MAP
+	} else if (strcmp(cmd, "map") == 0	// map keys to others
+	        || (i >= 2 && strncmp(cmd, "noremap", i) == 0)
+	        || (i >= 3 && strncmp(cmd, "unmap", i) == 0)
+	) {
+		// :map is in command mode, :map! in insert mode
+		char *rhs = skip_non_whitespace(args);
+		char lhs[MAX_INPUT_LEN];
+		int node = useforce;
+
+		if (*rhs) {
+			*rhs++ = '\0';
+			rhs = skip_whitespace(rhs);
+		}
+		map_keys(args);
+		map_keys(rhs);
+		if (cmd[0] == 'u') {
+			if (!args[0] || !map_set(useforce, args, NULL, 0))
+				status_line_bold("No such mapping");
+		} else if (rhs[0]) {
+			map_set(useforce, args, rhs, cmd[0] == 'n');
+		} else {
+			// list the maps starting with args
+			for (i = 0; maps && node >= 0 && args[i]; i++)
+				node = map_child(node, args[i]) ?: -1;
+			if (!maps || node < 0 || !maps[node].count) {
+				status_line_bold("No mapping found");
+				goto ret;
+			}
+			go_bottom_and_clear_to_eol();
+			puts("\r");
+			map_list(useforce, node, strcpy(lhs, args), i);
+			Hit_Return();
+		}
+# endif
+# if ENABLE_FEATURE_VI_STATS
+	} else if (strcmp(cmd, "stats") == 0) {	// system calls per key
+		// since the last :stats
+		unsigned long keys = T.keys;
+		unsigned long calls = __atomic_exchange_n(&T.syscalls, 0, __ATOMIC_RELAXED);
+		unsigned long per = keys ? calls * 100 / keys : 0;
+
+		status_line("%lu keys, %lu system calls, %lu.%02lu per key",
+			keys, calls, per / 100, per % 100);
+		T.keys = 0;
+# endif
 
 # if ENABLE_FEATURE_VI_SEARCH
 	} else if (cmd[0] == 's') {	// substitute a pattern with a replacement pattern
@@ -3019,8 +5284,8 @@ static void colon(char *buf)
 		int last_line = 0, lines = 0;
 #  endif
 #  if ENABLE_FEATURE_VI_REGEX_SEARCH
-		regex_t preg;
-		int cflags;
+		struct regex *preg;
+		const char *err;
 		char *Rorig;
 #   if ENABLE_FEATURE_VI_UNDO
 		int undo = 0;
@@ -3065,24 +5330,21 @@ static void colon(char *buf)
 
 #  if ENABLE_FEATURE_VI_REGEX_SEARCH
 		Rorig = R;
-		cflags = 0;
-		if (ignorecase)
-			cflags = REG_ICASE;
-		memset(&preg, 0, sizeof(preg));
-		if (regcomp(&preg, F, cflags) != 0) {
-			status_line(":s bad search pattern");
+		preg = get_regex(F, &err);
+		if (!preg) {
+			status_line(":s bad search pattern: %s", err);
 			goto regex_search_end;
 		}
 #  else
 		len_R = strlen(R);
 #  endif
 
-		for (i = b; i <= e; i++) {	// so, :20,23 s \0 find \0 replace \0
+		for (i = b; i <= e && !interrupted(); i++) {	// so, :20,23 s \0 find \0 replace \0
 			char *ls = q;		// orig line start
 			char *found;
  vc4:
 #  if ENABLE_FEATURE_VI_REGEX_SEARCH
-			found = regex_search(q, &preg, Rorig, &len_F, &len_R, &R);
+			found = regex_search(q, preg, Rorig, &len_F, &len_R, &R);
 #  else
 			found = char_search(q, F, (FORWARD << 1) | LIMITED);	// search cur line only for "find"
 #  endif
@@ -3126,15 +5388,17 @@ static void colon(char *buf)
 				}
 				// check for "global"  :s/foo/bar/g
 				if (gflag == 'g') {
-					if ((found + len_R) < end_line(ls)) {
-						q = found + len_R;
+					// past an empty match, not to find it again
+					q = found + len_R + !TEST_LEN_F;
+					if (q < end_line(ls))
 						goto vc4;	// don't let q move past cur line
-					}
 				}
 			}
 			q = next_line(ls);
 		}
-		if (subs == 0) {
+		if (interrupted()) {
+			status_line_bold("Interrupted");
+		} else if (subs == 0) {
 			status_line_bold("No match");
 		} else {
 			dot_skip_over_ws();
@@ -3144,8 +5408,7 @@ static void colon(char *buf)
 #  endif
 		}
 #  if ENABLE_FEATURE_VI_REGEX_SEARCH
- regex_search_end:
-		regfree(&preg);
+ regex_search_end: ;
 #  endif
 # endif /* FEATURE_VI_SEARCH */
 	} else if (strncmp(cmd, "version", i) == 0) {  // show software version
@@ -3351,10 +5614,15 @@ static void tstp_handler(int sig UNUSED_PARAM)
 
 	errno = save_errno;
 }
-static void int_handler(int sig)
+static void int_handler(int sig UNUSED_PARAM)
 {
 	signal(SIGINT, int_handler);
+#if ENABLE_FEATURE_VI_READER_THREAD
+	// long commands look at interrupted() and stop
+	interrupt_keys();
+#else
 	siglongjmp(restart, sig);
+#endif
 }
 #endif /* FEATURE_VI_USE_SIGNALS */
 
@@ -3433,7 +5701,9 @@ static int find_range(char **start, char **stop, int cmd)
 		do_cmd(c);		// execute movement cmd
 		// exclude last char unless range isn't what we expected
 		// this indicates we've hit EOL
-		if (tmpcnt == dot - p)
+		for (t = p; t < dot; t += char_len(t))
+			tmpcnt--;
+		if (tmpcnt == 0)
 			dot--;
 	}
 
@@ -3465,6 +5735,10 @@ static int find_range(char **start, char **stop, int cmd)
 		}
 	}
 
+	// a range ending on a multibyte char takes all of it
+	if (buftype != WHOLE)
+		q += char_len(q) - 1;
+
 	*start = p;
 	*stop = q;
 	return buftype;
@@ -3529,6 +5803,12 @@ static void do_cmd(int c)
 			goto key_cmd_mode;
 	}
 
+#if ENABLE_FEATURE_VI_PASTE
+	if (c == KEYCODE_PASTE) {
+		dot = paste_insert(dot);
+		goto dc1;
+	}
+#endif
 	if (cmd_mode == 2) {
 		//  flip-flop Insert/Replace mode
 		if (c == KEYCODE_INSERT)
@@ -3552,6 +5832,11 @@ static void do_cmd(int c)
 		if (c == KEYCODE_INSERT) goto dc5;
 		// insert the char c at "dot"
 		if (1 <= c || Isprint(c)) {
+#if ENABLE_FEATURE_VI_DOT_CMD
+			if (dot_replay && dot_plain(c))
+				dot = dot_insert(dot, c);
+			else
+#endif
 			dot = char_insert(dot, c, ALLOW_UNDO_QUEUED);
 		}
 		goto dc1;
@@ -3586,7 +5871,6 @@ static void do_cmd(int c)
 		//case ')':	// )-
 		//case '*':	// *-
 		//case '=':	// =-
-		//case '@':	// @-
 		//case 'K':	// K-
 		//case 'Q':	// Q-
 		//case 'S':	// S-
@@ -3627,7 +5911,7 @@ static void do_cmd(int c)
 	case 0x7f:	// DEL- move left   (This may be ERASE char)
 		do {
 			dot_left();
-		} while (--cmdcnt > 0);
+		} while (--cmdcnt > 0 && !interrupted());
 		break;
 	case 10:			// Newline ^J
 	case 'j':			// j- goto next line, same col
@@ -3642,7 +5926,7 @@ static void do_cmd(int c)
 				goto dc1;
 			}
 			q = p;
-		} while (--cmdcnt > 0);
+		} while (--cmdcnt > 0 && !interrupted());
 		dot = q;
 		if (c == 13 || c == '+') {
 			dot_skip_over_ws();
@@ -3675,11 +5959,11 @@ static void do_cmd(int c)
 	case KEYCODE_RIGHT:	// Cursor Key Right
 		do {
 			dot_right();
-		} while (--cmdcnt > 0);
+		} while (--cmdcnt > 0 && !interrupted());
 		break;
 #if ENABLE_FEATURE_VI_YANKMARK
 	case '"':			// "- name a register to use for Delete/Yank
-		c1 = (get_one_char() | 0x20) - 'a'; // | 0x20 is tolower()
+		c1 = (get_arg_char() | 0x20) - 'a'; // | 0x20 is tolower()
 		if ((unsigned)c1 <= 25) { // a-z?
 			YDreg = c1;
 		} else {
@@ -3687,7 +5971,7 @@ static void do_cmd(int c)
 		}
 		break;
 	case '\'':			// '- goto a specific mark
-		c1 = (get_one_char() | 0x20);
+		c1 = (get_arg_char() | 0x20);
 		if ((unsigned)(c1 - 'a') <= 25) { // a-z?
 			c1 = (c1 - 'a');
 			// get the b-o-l
@@ -3715,7 +5999,7 @@ static void do_cmd(int c)
 		// between text[0] and dot then this mark will not point to the
 		// correct location! It could be off by many lines!
 		// Well..., at least its quick and dirty.
-		c1 = (get_one_char() | 0x20) - 'a';
+		c1 = (get_arg_char() | 0x20) - 'a';
 		if ((unsigned)c1 <= 25) { // a-z?
 			// remember the line
 			mark[c1] = dot;
@@ -3758,7 +6042,9 @@ static void do_cmd(int c)
 # if ENABLE_FEATURE_VI_UNDO
 			allow_undo = ALLOW_UNDO_CHAIN;
 # endif
-		} while (--cmdcnt > 0);
+		} while (--cmdcnt > 0 && !interrupted());
+		if (cnt)	// not past the copies ^C left out
+			cnt -= MAX(cmdcnt, 0) * strlen(p);
 		dot += cnt;
 		dot_skip_over_ws();
 # if ENABLE_FEATURE_VI_YANKMARK && ENABLE_FEATURE_VI_VERBOSE_STATUS
@@ -3816,7 +6102,7 @@ static void do_cmd(int c)
 	case 'F':			// F- backward to a user specified char
 	case 't':			// t- move to char prior to next x
 	case 'T':			// T- move to char after previous x
-		last_search_char = get_one_char();	// get the search char
+		last_search_char = get_arg_char();	// get the search char
 		last_search_cmd = c;
 		// fall through
 	case ';':			// ;- look at rest of line for last search char
@@ -3828,11 +6114,67 @@ static void do_cmd(int c)
 		// Stuff the last_modifying_cmd back into stdin
 		// and let it be re-executed.
 		if (lmc_len != 0) {
+			char num[sizeof(int) * 3];
+			int n;
+
 			if (cmdcnt)	// update saved count if current count is non-zero
 				dotcnt = cmdcnt;
-			last_modifying_cmd[lmc_len] = '\0';
-			ioq = ioq_start = xasprintf("%u%s", dotcnt, last_modifying_cmd);
+			n = sprintf(num, "%u", dotcnt);
+			ioq_push(last_modifying_cmd, lmc_len);
+			ioq_push(num, n);
+			// the keys are replayed as they were, not mapped again
+			ioq_dot += n + lmc_len;
+			IF_FEATURE_VI_MAP(ioq_nore += n + lmc_len;)
+		}
+		break;
+#endif
+#if ENABLE_FEATURE_VI_MACRO
+	case 'q':			// q- record typed keys into a register
+		if (recording) {
+			// up to the q which stops it
+			if (rec_len && rec_buf[rec_len - 1] == 'q')
+				rec_len--;
+			i = recording - 'a';
+			free(reg[i]);
+			reg[i] = xstrndup(rec_buf, rec_len);
+			regtype[i] = PARTIAL;
+			recording = 0;
+			break;
+		}
+		c1 = get_arg_char();
+		if ((unsigned)((c1 | 0x20) - 'a') > 25) { // a-z?
+			indicate_error();
+			break;
 		}
+		recording = c1 | 0x20;
+		rec_len = 0;
+		p = reg[recording - 'a'];
+		if (c1 != recording && p)	// qA adds to register a
+			rec_add(p, strlen(p));
+		break;
+	case '@':			// @- replay the keys in a register
+		c1 = get_arg_char();
+		if (c1 == '@')
+			c1 = last_macro;	// @@ is the last one again
+		c1 |= 0x20;
+		if ((unsigned)(c1 - 'a') > 25) {
+			indicate_error();
+			break;
+		}
+		p = reg[c1 - 'a'];
+		if (!p || !p[0]) {
+			status_line_bold("Nothing in register %c", c1);
+			break;
+		}
+		last_macro = c1;
+		i = strlen(p);
+		cnt = cmdcnt ?: 1;
+		ioq_room(i * cnt, 0);
+		do {
+			ioq_push(p, i);
+			if (!ioq_macro)
+				ioq_macro = i;	// ioq_push() counts the others
+		} while (--cnt > 0);
 		break;
 #endif
 #if ENABLE_FEATURE_VI_SEARCH
@@ -3865,19 +6207,30 @@ static void do_cmd(int c)
 			break;
 		}
 		do {
+#if ENABLE_FEATURE_VI_SETOPTS
+			// found as it was typed?
+			i = inc_known(dot + dir, dir, last_search_pattern + 1, &q);
+			if (i > 0)
+				goto dc_wrapped;
+			if (i < 0)
+#endif
 			q = char_search(dot + dir, last_search_pattern + 1,
 						(dir << 1) | FULL);
 			if (q != NULL) {
 				dot = q;	// good search, update "dot"
-			} else {
+			} else if (!interrupted()) {
 				// no pattern found between "dot" and top/bottom of file
 				// continue from other end of file
 				const char *msg;
-				q = char_search(dir == FORWARD ? text : end - 1,
-						last_search_pattern + 1, (dir << 1) | FULL);
+				q = char_search_wrap(dot + dir, last_search_pattern + 1, dir);
+#if ENABLE_FEATURE_VI_SETOPTS
+ dc_wrapped:
+#endif
 				if (q != NULL) {	// found something
 					dot = q;	// found new pattern- goto it
 					msg = "search hit %s, continuing at %s";
+				} else if (interrupted()) {
+					break;	// ^C, which search_pieces() said
 				} else {	// pattern is nowhere in file
 					cmdcnt = 0;	// force exit from loop
 					msg = "Pattern not found";
@@ -3887,7 +6240,7 @@ static void do_cmd(int c)
 				else
 					status_line_bold(msg, "TOP", "BOTTOM");
 			}
-		} while (--cmdcnt > 0);
+		} while (--cmdcnt > 0 && !interrupted());
 		break;
 	case '{':			// {- move backward paragraph
 	case '}':			// }- move forward paragraph
@@ -3909,7 +6262,7 @@ static void do_cmd(int c)
 			}
 			goto dc6; // end of file
  dc2:		continue;
-		} while (--cmdcnt > 0);
+		} while (--cmdcnt > 0 && !interrupted());
 		break;
 #endif /* FEATURE_VI_SEARCH */
 	case '0':			// 0- goto beginning of line
@@ -3986,7 +6339,7 @@ static void do_cmd(int c)
 			}
 			if (c != 'W')
 				dot = skip_thing(dot, 1, dir, S_BEFORE_WS);
-		} while (--cmdcnt > 0);
+		} while (--cmdcnt > 0 && !interrupted());
 		break;
 	case 'C':			// C- Change to e-o-l
 	case 'D':			// D- delete to e-o-l
@@ -4002,7 +6355,7 @@ static void do_cmd(int c)
 #endif
 		break;
 	case 'g': // 'gg' goto a line number (vim) (default: very first line)
-		c1 = get_one_char();
+		c1 = get_arg_char();
 		if (c1 != 'g') {
 			buf[0] = 'g';
 			// c1 < 0 if the key was special. Try "g<up-arrow>"
@@ -4025,13 +6378,10 @@ static void do_cmd(int c)
 		dot_skip_over_ws();
 		break;
 	case 'H':			// H- goto top line on screen
-		dot = screenbegin;
 		if (cmdcnt > (rows - 1)) {
 			cmdcnt = (rows - 1);
 		}
-		while (--cmdcnt > 0) {
-			dot_next();
-		}
+		dot = screen_row(cmdcnt ? cmdcnt - 1 : 0);
 		dot_begin();
 		dot_skip_over_ws();
 		break;
@@ -4052,6 +6402,7 @@ static void do_cmd(int c)
 		do {
 			dot_end();		// move to NL
 			if (dot < end - 1) {	// make sure not last char in text[]
+				text_changing(dot, 0);
 #if ENABLE_FEATURE_VI_UNDO
 				undo_push(dot, 1, UNDO_DEL);
 				*dot++ = ' ';	// replace NL with space
@@ -4064,24 +6415,24 @@ static void do_cmd(int c)
 					text_hole_delete(dot, dot, ALLOW_UNDO_CHAIN);
 				}
 			}
-		} while (--cmdcnt > 0);
+		} while (--cmdcnt > 0 && !interrupted());
 		end_cmd_q();	// stop adding to q
 		break;
 	case 'L':			// L- goto bottom line on screen
-		dot = end_screen();
 		if (cmdcnt > (rows - 1)) {
 			cmdcnt = (rows - 1);
 		}
-		while (--cmdcnt > 0) {
-			dot_prev();
-		}
+		// last row which shows text
+		rows_update();
+		for (cnt = rows - 2; cnt > 0 && text + row_start[cnt] >= end; cnt--)
+			continue;
+		cnt -= cmdcnt ? cmdcnt - 1 : 0;
+		dot = screen_row(cnt > 0 ? cnt : 0);
 		dot_begin();
 		dot_skip_over_ws();
 		break;
 	case 'M':			// M- goto middle line on screen
-		dot = screenbegin;
-		for (cnt = 0; cnt < (rows-1) / 2; cnt++)
-			dot = next_line(dot);
+		dot = screen_row((rows-1) / 2);
 		dot_skip_over_ws();
 		break;
 	case 'O':			// O- open an empty line above
@@ -4123,19 +6474,19 @@ static void do_cmd(int c)
 		do {
 			if (dot[dir] != '\n') {
 				if (c == 'X')
-					dot--;	// delete prev char
-				dot = yank_delete(dot, dot, PARTIAL, YANKDEL, allow_undo);	// delete char
+					dot = char_start(dot - 1);	// delete prev char
+				dot = yank_delete(dot, dot + char_len(dot) - 1, PARTIAL, YANKDEL, allow_undo);	// delete char
 #if ENABLE_FEATURE_VI_UNDO
 				allow_undo = ALLOW_UNDO_CHAIN;
 #endif
 			}
-		} while (--cmdcnt > 0);
+		} while (--cmdcnt > 0 && !interrupted());
 		end_cmd_q();	// stop adding to q
 		if (c == 's')
 			goto dc_i;	// start inserting
 		break;
 	case 'Z':			// Z- if modified, {write}; exit
-		c1 = get_one_char();
+		c1 = get_arg_char();
 		// ZQ means to exit without saving
 		if (c1 == 'Q') {
 			editing = 0;
@@ -4192,7 +6543,7 @@ static void do_cmd(int c)
 			} else if (ispunct(*dot)) {
 				dot = skip_thing(dot, 1, dir, S_END_PUNCT);
 			}
-		} while (--cmdcnt > 0);
+		} while (--cmdcnt > 0 && !interrupted());
 		break;
 	case 'c':			// c- change something
 	case 'd':			// d- delete something
@@ -4266,7 +6617,7 @@ static void do_cmd(int c)
 				goto dc1;
 			}
 			q = p;
-		} while (--cmdcnt > 0);
+		} while (--cmdcnt > 0 && !interrupted());
 		dot = q;
 		if (c == '-') {
 			dot_skip_over_ws();
@@ -4277,19 +6628,34 @@ static void do_cmd(int c)
 		}
 		break;
 	case 'r':			// r- replace the current char with user input
-		c1 = get_one_char();	// get the replacement char
+		c1 = get_arg_char();	// get the replacement char
 		if (c1 != 27) {
+			char seq[4];
+			int n = 1;
+
+			seq[0] = c1;
+#if ENABLE_FEATURE_VI_UTF8
+			// the rest of a multibyte char
+			if (utf8 && c1 >= 0xc2 && c1 < 0xf5) {
+				int len = c1 < 0xe0 ? 2 : c1 < 0xf0 ? 3 : 4;
+				while (n < len)
+					seq[n++] = get_arg_char();
+			}
+#endif
 			if (end_line(dot) - dot < (cmdcnt ?: 1)) {
 				indicate_error();
 				goto dc6;
 			}
 			do {
-				dot = text_hole_delete(dot, dot, allow_undo);
+				int i;
+
+				dot = text_hole_delete(dot, dot + char_len(dot) - 1, allow_undo);
 #if ENABLE_FEATURE_VI_UNDO
 				allow_undo = ALLOW_UNDO_CHAIN;
 #endif
-				dot = char_insert(dot, c1, allow_undo);
-			} while (--cmdcnt > 0);
+				for (i = 0; i < n; i++)
+					dot = char_insert(dot, seq[i], allow_undo);
+			} while (--cmdcnt > 0 && !interrupted());
 			dot_left();
 		}
 		end_cmd_q();	// stop adding to q
@@ -4306,10 +6672,10 @@ static void do_cmd(int c)
 			if (isspace(*dot)) {
 				dot = skip_thing(dot, 2, FORWARD, S_OVER_WS);
 			}
-		} while (--cmdcnt > 0);
+		} while (--cmdcnt > 0 && !interrupted());
 		break;
 	case 'z':			// z-
-		c1 = get_one_char();	// get the replacement char
+		c1 = get_arg_char();	// get the replacement char
 		cnt = 0;
 		if (c1 == '.')
 			cnt = (rows - 2) / 2;	// put dot at center
@@ -4325,12 +6691,15 @@ static void do_cmd(int c)
 		do {
 #if ENABLE_FEATURE_VI_UNDO
 			if (isalpha(*dot)) {
+				text_changing(dot, 0);
 				undo_push(dot, 1, undo_del);
 				*dot = islower(*dot) ? toupper(*dot) : tolower(*dot);
 				undo_push(dot, 1, UNDO_INS_CHAIN);
 				undo_del = UNDO_DEL_CHAIN;
 			}
 #else
+			if (isalpha(*dot))
+				text_changing(dot, 0);
 			if (islower(*dot)) {
 				*dot = toupper(*dot);
 				modified_count++;
@@ -4340,7 +6709,7 @@ static void do_cmd(int c)
 			}
 #endif
 			dot_right();
-		} while (--cmdcnt > 0);
+		} while (--cmdcnt > 0 && !interrupted());
 		end_cmd_q();	// stop adding to q
 		break;
 		//----- The Cursor and Function Keys -----------------------------
@@ -4385,7 +6754,7 @@ static void do_cmd(int c)
 	cnt = dot - begin_line(dot);
 	// Try to stay off of the Newline
 	if (*dot == '\n' && cnt > 0 && cmd_mode == 0)
-		dot--;
+		dot = char_start(dot - 1);
 }
 
 // NB!  the CRASHME code is unmaintained, and doesn't currently build
@@ -4653,8 +7022,8 @@ static void edit_file(char *fn)
 	offset = 0;			// no horizontal offset
 	c = '\0';
 #if ENABLE_FEATURE_VI_DOT_CMD
-	free(ioq_start);
-	ioq_start = NULL;
+	ioq_flush();
+	IF_FEATURE_VI_MAP(pending_key = 0;)
 	adding2q = 0;
 #endif
 
@@ -4692,7 +7061,7 @@ static void edit_file(char *fn)
 		// If c is a command that changes text[],
 		// (re)start remembering the input for the "." command.
 		if (!adding2q
-		 && ioq_start == NULL
+		 && !dot_replay
 		 && cmd_mode == 0 // command mode
 		 && c > '\0' // exclude NUL and non-ASCII chars
 		 && c < 0x7f // (Unicode and such)
@@ -4702,15 +7071,35 @@ static void edit_file(char *fn)
 		}
 #endif
 		do_cmd(c);		// execute the user command
+		dot = char_start(dot);	// motions may stop inside a char
+#if ENABLE_FEATURE_VI_MACRO
+		if (ioq_macro)
+			refresh(FALSE);	// draws nothing yet, see there
+#endif
 
 		// poll to see if there is input already waiting. if we are
 		// not able to display output fast enough to keep up, skip
 		// the display update until we catch up with input.
-		if (!readbuffer[0] && mysleep(0) == 0) {
-			// no input pending - so update output
-			refresh(FALSE);
-			show_status_line();
+		// While the terminal is still draining earlier output, hold
+		// the frame back: if more input arrives meanwhile it would be
+		// stale anyway, otherwise the latest state is drawn once the
+		// queue goes down.
+		while (!key_waiting()) {
+			if (!output_backlog()) {
+				// no input pending - so update output
+				refresh(FALSE);
+				show_status_line();
+#if ENABLE_FEATURE_VI_SETOPTS
+				if (showmatch_ofs >= 0)
+					show_pending_match();
+#endif
+				break;
+			}
+			mysleep(1);
 		}
+#if ENABLE_FEATURE_VI_SETOPTS
+		showmatch_ofs = -1;	// skipped if more input was waiting
+#endif
 #if ENABLE_FEATURE_VI_CRASHME
 		if (crashme > 0)
 			crash_test();	// test editor variables
@@ -4718,6 +7107,7 @@ static void edit_file(char *fn)
 	}
 	//-------------------------------------------------------------------
 
+	end_timed();
 	go_bottom_and_clear_to_eol();
 	cookmode();
 #undef cur_line
@@ -4759,7 +7149,10 @@ int vi_main(int argc, char **argv)
 	/* "" but has space for 2 chars: */
 	IF_FEATURE_VI_SEARCH(last_search_pattern = xzalloc(2);)
 	tabstop = 8;
+	timeoutlen = 1000;
+	esc_timeout = 50;
 	IF_FEATURE_VI_SETOPTS(newindent--;)
+	IF_FEATURE_VI_SETOPTS(showmatch_ofs--;)
 
 #if ENABLE_FEATURE_VI_UNDO
 	//undo_stack_tail = NULL; - already is
@@ -4781,6 +7174,12 @@ int vi_main(int argc, char **argv)
 
 	// 0: all of our options are disabled by default in vim
 	//vi_setops = 0;
+#if ENABLE_FEATURE_VI_SETOPTS
+	// except that we save bytes on serial lines
+	if (slow_tty())
+		vi_setops |= VI_SLOWOPEN;
+#endif
+	IF_FEATURE_VI_UTF8(utf8 = utf8_locale();)
   while ((c = getopt(argc, argv, "hCRH" IF_FEATURE_VI_COLON("c:"))) != -1) {
       switch (c) {
 #if ENABLE_FEATURE_VI_CRASHME